@@ -0,0 +1,597 @@
+// Benchmarks for the document engine.
+//
+// Build:  g++ -std=c++17 -O2 -pthread -o document_editor_benchmark document_editor_benchmark.cpp
+// Run:    ./document_editor_benchmark [options]     (--help lists them)
+//
+// Each benchmark runs on a synthetic document and reports time per operation,
+// heap allocations per operation and throughput. --json writes the same
+// results in a machine-readable form for regression tracking.
+
+#define DOCUMENT_EDITOR_NO_MAIN
+#include "structured_document_editor_framework.cpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+#include <random>
+
+// ==========================================================
+// ALLOCATION COUNTING
+// ==========================================================
+
+// Every global operator new goes through here so benchmarks can report
+// how many allocations, and how many bytes, an operation costs.
+namespace allocation_counter {
+std::atomic<uint64_t> count{ 0 };
+std::atomic<uint64_t> bytes{ 0 };
+
+void* allocate(size_t size) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+}
+
+void* operator new(size_t size) { return allocation_counter::allocate(size); }
+void* operator new[](size_t size) { return allocation_counter::allocate(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocation_counter::count.fetch_add(1, std::memory_order_relaxed);
+    allocation_counter::bytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+// ==========================================================
+// SYNTHETIC DOCUMENTS
+// ==========================================================
+
+// Shape of the generated document: a tree of sections `depth` levels deep
+// with `fanout` subsections each, every section holding the given content.
+struct DocumentShape {
+    size_t depth = 3;
+    size_t fanout = 4;
+    size_t paragraphs = 20;   // Per section
+    size_t words = 12;        // Per paragraph
+    size_t images = 1;        // Per section
+    size_t tables = 1;        // Per section
+    size_t decorateEvery = 4; // Every Nth paragraph is bold or italic; 0 disables
+    size_t styleEvery = 3;    // Every Nth paragraph gets style runs; 0 disables
+    uint32_t seed = 42;
+};
+
+class SyntheticDocumentBuilder {
+private:
+    const DocumentShape& shape;
+    std::mt19937 random;
+    std::vector<FormatHandle> formats;
+    size_t paragraphCount;
+
+    std::string makeText() {
+        static const char* const vocabulary[] = {
+            "document", "editor", "section", "paragraph", "the", "a", "of", "render",
+            "layout", "pattern", "<tag>", "text", "format", "undo", "R&D", "\"quoted\"",
+        };
+        std::string text;
+        for (size_t i = 0; i < shape.words; i++) {
+            if (i > 0) text += ' ';
+            text += vocabulary[random() % (sizeof(vocabulary) / sizeof(vocabulary[0]))];
+        }
+        return text;
+    }
+
+    std::unique_ptr<DocumentElement> makeParagraph() {
+        size_t n = paragraphCount++;
+        auto para = std::make_unique<Paragraph>(makeText(), formats[n % formats.size()]);
+        if (shape.styleEvery > 0 && n % shape.styleEvery == 0 && para->getText().length() > 8) {
+            para->applyStyle(0, 4, formats[(n + 1) % formats.size()], StyleRun::Bold);
+            para->applyStyle(6, 3, kNoFormat, StyleRun::Italic);
+        }
+        if (shape.decorateEvery > 0 && n % shape.decorateEvery == 0) {
+            if ((n / shape.decorateEvery) % 2 == 0) return std::make_unique<BoldDecorator>(std::move(para));
+            return std::make_unique<ItalicDecorator>(std::move(para));
+        }
+        return para;
+    }
+
+    void fill(Section* section, size_t level) {
+        for (size_t i = 0; i < shape.paragraphs; i++) section->add(makeParagraph());
+        for (size_t i = 0; i < shape.images; i++) section->add(std::make_unique<Image>("image" + std::to_string(i) + ".png"));
+        for (size_t i = 0; i < shape.tables; i++) section->add(std::make_unique<Table>(4, 3));
+        if (level + 1 >= shape.depth) return;
+        for (size_t i = 0; i < shape.fanout; i++) {
+            auto child = std::make_unique<Section>("Section " + std::to_string(level + 1) + "." + std::to_string(i));
+            fill(child.get(), level + 1);
+            section->add(std::move(child));
+        }
+    }
+
+public:
+    explicit SyntheticDocumentBuilder(const DocumentShape& s) : shape(s), random(s.seed), paragraphCount(0) {
+        static const char* const fonts[] = { "Arial", "Times", "Courier", "Helvetica" };
+        for (int i = 0; i < 16; i++) {
+            formats.push_back(CharacterFormatFactory::internQuiet(fonts[i % 4], 10 + i, i % 2 ? "Black" : "Blue"));
+        }
+    }
+
+    void build(Document& doc) { fill(doc.getRootSection(), 0); }
+};
+
+// ==========================================================
+// BENCHMARK RUNNER
+// ==========================================================
+
+// Work done by one operation, used for throughput
+struct Work {
+    double items;
+    double bytes;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double minNsPerOp;
+    double medianNsPerOp;
+    double allocsPerOp;
+    double bytesAllocatedPerOp;
+    Work workPerOp;
+};
+
+// Discards the framework's std::cout logging (commands, state changes,
+// proxies); benchmark reports are written with printf.
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return traits_type::not_eof(c); }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+class BenchmarkRunner {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::FILE* console;  // Human-readable report
+    std::string filter;
+    double minSeconds;
+    uint64_t minIterations;
+    std::vector<BenchmarkResult> results;
+
+public:
+    BenchmarkRunner(std::FILE* out, std::string nameFilter, double seconds, uint64_t iterations)
+        : console(out), filter(std::move(nameFilter)), minSeconds(seconds), minIterations(iterations) {}
+
+    bool enabled(const std::string& name) const { return filter.empty() || name.find(filter) != std::string::npos; }
+
+    // Times op() until both the minimum time and iteration count are reached.
+    // after() runs untimed between iterations, e.g. to free what op() built.
+    template <typename Op, typename After>
+    void run(const std::string& name, Op&& op, After&& after) {
+        if (!enabled(name)) return;
+
+        Work work = op();  // Warm-up
+        after();
+
+        std::vector<double> samples;
+        samples.reserve(1024);
+        uint64_t allocs = 0;
+        uint64_t allocated = 0;
+        double total = 0;
+        while (samples.size() < minIterations || total < minSeconds * 1e9) {
+            uint64_t countBefore = allocation_counter::count.load(std::memory_order_relaxed);
+            uint64_t bytesBefore = allocation_counter::bytes.load(std::memory_order_relaxed);
+            auto start = Clock::now();
+            work = op();
+            auto stop = Clock::now();
+            allocs += allocation_counter::count.load(std::memory_order_relaxed) - countBefore;
+            allocated += allocation_counter::bytes.load(std::memory_order_relaxed) - bytesBefore;
+            after();
+            double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+            samples.push_back(ns);
+            total += ns;
+        }
+
+        std::vector<double> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+        double n = static_cast<double>(samples.size());
+        results.push_back(BenchmarkResult{ name, samples.size(), total / n, sorted.front(), sorted[sorted.size() / 2],
+            allocs / n, allocated / n, work });
+        report(results.back());
+    }
+
+    template <typename Op>
+    void run(const std::string& name, Op&& op) {
+        run(name, std::forward<Op>(op), [] {});
+    }
+
+    void report(const BenchmarkResult& r) const {
+        double seconds = r.nsPerOp / 1e9;
+        std::fprintf(console, "%-28s %10llu %14.0f %14.0f %10.1f %14.0f %14.3e", r.name.c_str(),
+            static_cast<unsigned long long>(r.iterations), r.nsPerOp, r.medianNsPerOp, r.allocsPerOp,
+            r.bytesAllocatedPerOp, r.workPerOp.items / seconds);
+        if (r.workPerOp.bytes > 0) std::fprintf(console, " %10.1f", r.workPerOp.bytes / seconds / 1e6);
+        std::fprintf(console, "\n");
+    }
+
+    void printHeader() const {
+        std::fprintf(console, "%-28s %10s %14s %14s %10s %14s %14s %10s\n", "benchmark", "iters", "ns/op", "median ns",
+            "allocs/op", "bytes/op", "items/s", "MB/s");
+    }
+
+    bool writeJson(std::FILE* out, const DocumentShape& shape, size_t elements, size_t words) const {
+        std::fprintf(out, "{\n  \"context\": {\n");
+        std::fprintf(out, "    \"compiler\": \"%s\",\n", __VERSION__);
+        std::fprintf(out, "    \"cplusplus\": %ld,\n", static_cast<long>(__cplusplus));
+        std::fprintf(out, "    \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+        std::fprintf(out, "    \"shape\": {\"depth\": %zu, \"fanout\": %zu, \"paragraphs\": %zu, \"words\": %zu, "
+            "\"images\": %zu, \"tables\": %zu, \"decorate_every\": %zu, \"style_every\": %zu, \"seed\": %u},\n",
+            shape.depth, shape.fanout, shape.paragraphs, shape.words, shape.images, shape.tables,
+            shape.decorateEvery, shape.styleEvery, shape.seed);
+        std::fprintf(out, "    \"elements\": %zu,\n    \"words\": %zu\n  },\n  \"benchmarks\": [\n", elements, words);
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult& r = results[i];
+            double seconds = r.nsPerOp / 1e9;
+            std::fprintf(out, "    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, "
+                "\"median_ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_allocated_per_op\": %.1f, "
+                "\"items_per_op\": %.0f, \"bytes_per_op\": %.0f, \"items_per_second\": %.1f, \"bytes_per_second\": %.1f}%s\n",
+                r.name.c_str(), static_cast<unsigned long long>(r.iterations), r.nsPerOp, r.minNsPerOp, r.medianNsPerOp,
+                r.allocsPerOp, r.bytesAllocatedPerOp, r.workPerOp.items, r.workPerOp.bytes,
+                r.workPerOp.items / seconds, r.workPerOp.bytes / seconds, i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(out, "  ]\n}\n");
+        return std::ferror(out) == 0;
+    }
+};
+
+// ==========================================================
+// BENCHMARKS
+// ==========================================================
+
+void runBenchmarks(BenchmarkRunner& runner, Document& doc, size_t elements) {
+    Section* root = doc.getRootSection();
+    double count = static_cast<double>(elements);
+
+    // [BRIDGE] - Rendering into memory, so the numbers exclude terminal I/O
+    {
+        MemorySink sink;
+        ConsoleRenderer console(sink);
+        runner.run("draw/console", [&] {
+            root->draw(&console);
+            console.flush();
+            return Work{ count, static_cast<double>(sink.size()) };
+        }, [&] { sink.clear(); });
+
+        HTMLRenderer html(sink);
+        runner.run("draw/html", [&] {
+            root->draw(&html);
+            html.flush();
+            return Work{ count, static_cast<double>(sink.size()) };
+        }, [&] { sink.clear(); });
+
+        ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+        runner.run("draw_parallel/console", [&] {
+            root->drawParallel(&console, pool);
+            console.flush();
+            return Work{ count, static_cast<double>(sink.size()) };
+        }, [&] { sink.clear(); });
+
+        // Live preview: one keystroke in the middle paragraph, then a redraw
+        // that re-renders only the edited path
+        Paragraph* middle = nullptr;
+        size_t seen = 0;
+        for (DocumentElement& element : DocumentIterator(root)) {
+            if (Paragraph* para = elementCast<Paragraph>(&element)) {
+                if (seen++ * 2 <= elements) middle = para;
+            }
+        }
+        if (middle) {
+            RetainedRenderer retained(&html);
+            retained.draw(doc);
+            sink.clear();
+            runner.run("draw_retained/html_edit", [&] {
+                middle->insertText(0, "x");
+                retained.draw(doc);
+                middle->eraseText(0, 1);
+                retained.draw(doc);
+                return Work{ 2, static_cast<double>(sink.size()) };
+            }, [&] { sink.clear(); });
+        }
+    }
+
+    // [PROTOTYPE] - Copy of the whole tree, then the copy plus one edit in
+    // its deepest section; copies are freed untimed
+    {
+        std::unique_ptr<DocumentElement> copy;
+        runner.run("clone/root", [&] {
+            copy = root->clone();
+            return Work{ count, 0 };
+        }, [&] { copy.reset(); });
+
+        runner.run("clone/root_first_edit", [&] {
+            copy = root->clone();
+            Section* section = static_cast<Section*>(copy.get());
+            while (!section->getChildren().empty()) {
+                Section* last = elementCast<Section>(section->getChildren().back().get());
+                if (!last) break;
+                section = last;
+            }
+            if (!section->getChildren().empty()) {
+                if (Paragraph* para = elementCast<Paragraph>(section->getChildren().front().get())) para->insertText(0, "Edited ");
+            }
+            return Work{ count, 0 };
+        }, [&] { copy.reset(); });
+    }
+
+    // [VISITOR]
+    {
+        runner.run("accept/word_count", [&] {
+            WordCountVisitor visitor;
+            root->accept(&visitor);
+            return Work{ count, 0 };
+        });
+
+        MemorySink sink;
+        runner.run("accept/xml_export", [&] {
+            XMLExportVisitor visitor(sink);
+            root->accept(&visitor);
+            visitor.flush();
+            return Work{ count, static_cast<double>(sink.size()) };
+        }, [&] { sink.clear(); });
+    }
+
+    // [ITERATOR]
+    runner.run("iterate/document_iterator", [&] {
+        size_t visited = 0;
+        for (DocumentElement& element : DocumentIterator(root)) {
+            visited += element.getKind() != ElementKind::Opaque;
+        }
+        return Work{ static_cast<double>(visited), 0 };
+    });
+
+    // Element IDs resolved through the document's index
+    {
+        std::vector<uint64_t> ids;
+        for (DocumentElement& element : DocumentIterator(root)) ids.push_back(element.getId());
+        runner.run("index/find_element", [&] {
+            size_t found = 0;
+            for (uint64_t id : ids) found += doc.findElement(id) != nullptr;
+            return Work{ static_cast<double>(found), 0 };
+        });
+    }
+
+    // [FLYWEIGHT] - Lookups of formats that already exist, as while typing
+    {
+        static const char* const fonts[] = { "Arial", "Times", "Courier", "Helvetica" };
+        static const char* const colors[] = { "Black", "Blue", "Red", "Green" };
+        CharacterFormatFactory factory;
+        const size_t lookups = 4096;
+        runner.run("format/get_format", [&] {
+            size_t found = 0;
+            for (size_t i = 0; i < lookups; i++) {
+                found += factory.getFormat(fonts[i % 4], 10 + static_cast<int>(i % 16), colors[(i / 4) % 4]) != nullptr;
+            }
+            return Work{ static_cast<double>(found), 0 };
+        });
+    }
+
+    // [COMMAND] - A burst of edits followed by undoing all of them
+    {
+        const size_t edits = 256;
+        CommandHistory history;
+        Section* target = root;
+        runner.run("command/add_execute_undo", [&] {
+            for (size_t i = 0; i < edits; i++) {
+                history.executeCommand(std::make_unique<AddElementCommand>(&doc, target, target->getChildren().size(),
+                    std::make_unique<Paragraph>("Inserted by a benchmark command")));
+            }
+            for (size_t i = 0; i < edits; i++) history.undo();
+            return Work{ static_cast<double>(2 * edits), 0 };
+        });
+
+        std::vector<Paragraph*> paragraphs;
+        for (DocumentElement& element : DocumentIterator(root)) {
+            if (Paragraph* para = elementCast<Paragraph>(&element)) paragraphs.push_back(para);
+            if (paragraphs.size() == edits) break;
+        }
+        if (!paragraphs.empty()) {
+            FormatHandle format = CharacterFormatFactory::internQuiet("Georgia", 14, "Black");
+            runner.run("command/format_execute_undo", [&] {
+                for (Paragraph* para : paragraphs) history.executeCommand(std::make_unique<FormatCommand>(&doc, para, format));
+                for (size_t i = 0; i < paragraphs.size(); i++) history.undo();
+                return Work{ static_cast<double>(2 * paragraphs.size()), 0 };
+            });
+        }
+    }
+
+    // [BUILDER] page properties drive layout; an edit in the middle of the
+    // document only re-lays out what changed
+    {
+        runner.run("layout/full", [&] {
+            LayoutEngine layout(&doc);
+            layout.update();
+            return Work{ count, 0 };
+        });
+
+        LayoutEngine layout(&doc);
+        layout.update();
+        std::vector<Paragraph*> paragraphs;
+        for (DocumentElement& element : DocumentIterator(root)) {
+            if (Paragraph* para = elementCast<Paragraph>(&element)) paragraphs.push_back(para);
+        }
+        if (!paragraphs.empty()) {
+            Paragraph* middle = paragraphs[paragraphs.size() / 2];
+            runner.run("layout/edit_middle", [&] {
+                middle->insertText(0, "x");
+                layout.update();
+                middle->eraseText(0, 1);
+                layout.update();
+                return Work{ 2, 0 };
+            });
+        }
+    }
+
+    // [FACADE] - Reading a saved copy back from its memory-mapped file into
+    // a fresh arena-backed document; loaded documents are freed untimed
+    if (runner.enabled("file/load")) {
+        std::string path = (std::filesystem::temp_directory_path() / "document_editor_benchmark.sdoc").string();
+        FileManagerFacade files;
+        files.save(&doc, path);
+        std::unique_ptr<Document> loaded;
+        runner.run("file/load", [&] {
+            loaded = files.load(path);
+            return Work{ count, 0 };
+        }, [&] { loaded.reset(); });
+        std::remove(path.c_str());
+    }
+
+    // Full-text index; enabled last so it does not tax the edits above
+    static const char* const searches[] = { "search/term", "search/phrase", "search/prefix", "search/reindex_edit" };
+    if (std::any_of(std::begin(searches), std::end(searches), [&](const char* name) { return runner.enabled(name); })) {
+        doc.enableTextIndex();
+        const TextIndex* text = doc.getTextIndex();
+        runner.run("search/term", [&] {
+            return Work{ static_cast<double>(text->findTerm("pattern").size()), 0 };
+        });
+        runner.run("search/phrase", [&] {
+            return Work{ static_cast<double>(text->findPhrase("the document").size()), 0 };
+        });
+        runner.run("search/prefix", [&] {
+            return Work{ static_cast<double>(text->findPrefix("p").size()), 0 };
+        });
+
+        Paragraph* para = nullptr;
+        for (DocumentElement& element : DocumentIterator(root)) {
+            if ((para = elementCast<Paragraph>(&element))) break;
+        }
+        if (para) {
+            runner.run("search/reindex_edit", [&] {
+                doc.insertText(para, 0, "typed ");
+                doc.eraseText(para, 0, 6);
+                return Work{ 2, 0 };
+            });
+        }
+        doc.disableTextIndex();
+    }
+}
+
+// ==========================================================
+// MAIN
+// ==========================================================
+
+void printUsage(const char* program) {
+    std::printf("Usage: %s [options]\n"
+        "  --depth N            section nesting depth (default 3)\n"
+        "  --fanout N           subsections per section (default 4)\n"
+        "  --paragraphs N       paragraphs per section (default 20)\n"
+        "  --words N            words per paragraph (default 12)\n"
+        "  --images N           images per section (default 1)\n"
+        "  --tables N           tables per section (default 1)\n"
+        "  --decorate-every N   wrap every Nth paragraph in a decorator, 0 = never (default 4)\n"
+        "  --style-every N      give every Nth paragraph style runs, 0 = never (default 3)\n"
+        "  --seed N             text generator seed (default 42)\n"
+        "  --min-time SECONDS   minimum measured time per benchmark (default 0.5)\n"
+        "  --min-iterations N   minimum iterations per benchmark (default 5)\n"
+        "  --filter TEXT        only run benchmarks whose name contains TEXT\n"
+        "  --json PATH          also write results as JSON to PATH (- for stdout)\n", program);
+}
+
+bool parseCount(const char* text, size_t& value) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long parsed = std::strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0') return false;
+    value = static_cast<size_t>(parsed);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    DocumentShape shape;
+    double minSeconds = 0.5;
+    size_t minIterations = 5;
+    std::string filter;
+    std::string jsonPath;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printUsage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            std::fprintf(stderr, "Missing value for %s\n", arg.c_str());
+            return 1;
+        }
+        const char* value = argv[++i];
+        size_t number = 0;
+        bool ok = true;
+        if (arg == "--filter") filter = value;
+        else if (arg == "--json") jsonPath = value;
+        else if (arg == "--min-time") {
+            char* end = nullptr;
+            minSeconds = std::strtod(value, &end);
+            ok = end != value && *end == '\0' && minSeconds >= 0;
+        }
+        else if (!parseCount(value, number)) ok = false;
+        else if (arg == "--depth") shape.depth = std::max<size_t>(number, 1);
+        else if (arg == "--fanout") shape.fanout = number;
+        else if (arg == "--paragraphs") shape.paragraphs = number;
+        else if (arg == "--words") shape.words = number;
+        else if (arg == "--images") shape.images = number;
+        else if (arg == "--tables") shape.tables = number;
+        else if (arg == "--decorate-every") shape.decorateEvery = number;
+        else if (arg == "--style-every") shape.styleEvery = number;
+        else if (arg == "--seed") shape.seed = static_cast<uint32_t>(number);
+        else if (arg == "--min-iterations") minIterations = std::max<size_t>(number, 1);
+        else {
+            std::fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (!ok) {
+            std::fprintf(stderr, "Invalid value for %s: %s\n", arg.c_str(), value);
+            return 1;
+        }
+    }
+
+    NullBuffer null;
+    std::cout.rdbuf(&null);
+
+    Document doc;
+    SyntheticDocumentBuilder(shape).build(doc);
+    size_t elements = 0;
+    for (DocumentElement& element : DocumentIterator(doc.getRootSection())) {
+        (void)element;
+        elements++;
+    }
+    WordCountVisitor words;
+    doc.getRootSection()->accept(&words);
+
+    // With JSON on stdout the table moves to stderr
+    std::FILE* console = jsonPath == "-" ? stderr : stdout;
+    std::fprintf(console, "Document: %zu elements, %d words (depth %zu, fanout %zu, %zu paragraphs x %zu words per section)\n\n",
+        elements, words.getWordCount(), shape.depth, shape.fanout, shape.paragraphs, shape.words);
+    BenchmarkRunner runner(console, filter, minSeconds, minIterations);
+    runner.printHeader();
+    runBenchmarks(runner, doc, elements);
+
+    if (!jsonPath.empty()) {
+        std::FILE* out = jsonPath == "-" ? stdout : std::fopen(jsonPath.c_str(), "w");
+        if (!out) {
+            std::fprintf(stderr, "Cannot open %s: %s\n", jsonPath.c_str(), std::strerror(errno));
+            return 1;
+        }
+        bool written = runner.writeJson(out, shape, elements, static_cast<size_t>(words.getWordCount()));
+        if (out != stdout) written = std::fclose(out) == 0 && written;
+        if (!written) {
+            std::fprintf(stderr, "Failed to write %s\n", jsonPath.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+// Regression tests for the document engine.
+//
+// Build:  g++ -std=c++17 -O2 -pthread -o document_editor_tests document_editor_tests.cpp
+// Run:    ./document_editor_tests
+//
+// Prints one line per failed check and exits non-zero if any failed.
+
+#define DOCUMENT_EDITOR_NO_MAIN
+#include "structured_document_editor_framework.cpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if (condition) return;
+    std::cout << "FAILED: " << what << std::endl;
+    failures++;
+}
+
+struct RecordedElement {
+    uint64_t id;
+    uint64_t parentId;  // 0 for the root
+    std::string type;
+};
+
+// Every element of the tree with the ID of its parent, root first
+std::vector<std::pair<const DocumentElement*, uint64_t>> collectElements(const DocumentElement* root) {
+    std::vector<std::pair<const DocumentElement*, uint64_t>> out;
+    std::vector<std::pair<const DocumentElement*, uint64_t>> pending{ { root, 0 } };
+    while (!pending.empty()) {
+        auto entry = pending.back();
+        pending.pop_back();
+        out.push_back(entry);
+        uint64_t id = entry.first->getId();
+        if (auto* decorator = elementCast<TextDecorator>(entry.first)) {
+            pending.push_back({ decorator->getWrapped(), id });
+        }
+        else if (auto* section = elementCast<Section>(entry.first)) {
+            for (auto& child : section->getChildren()) pending.push_back({ child.get(), id });
+        }
+    }
+    return out;
+}
+
+std::unique_ptr<Section> makeChapter(const std::string& name) {
+    auto chapter = std::make_unique<Section>(name);
+    chapter->add(std::make_unique<Paragraph>("Opening words of " + name));
+    chapter->add(std::make_unique<BoldDecorator>(std::make_unique<Paragraph>("Key point")));
+    auto inner = std::make_unique<Section>(name + ".1");
+    inner->add(std::make_unique<Paragraph>("Nested text"));
+    inner->add(std::make_unique<Table>(2, 3));
+    chapter->add(std::move(inner));
+    return chapter;
+}
+
+// Every element the memento recorded can be found by ID, with its parent,
+// as soon as the restore returns
+void testLookupsAfterRestore() {
+    Document doc;
+    Section* root = doc.getRootSection();
+    for (int i = 0; i < 3; ++i) root->add(makeChapter("Chapter " + std::to_string(i + 1)));
+    std::vector<RecordedElement> recorded;
+    for (auto& [element, parentId] : collectElements(root)) recorded.push_back({ element->getId(), parentId, element->getType() });
+    size_t indexed = doc.indexedElementCount();
+    DocumentMemento memento = doc.createMemento();
+
+    root->remove(0);
+    root->add(std::make_unique<Paragraph>("Added after the checkpoint"));
+    doc.restoreMemento(memento);
+
+    check(doc.indexedElementCount() == indexed, "restore indexes every restored element");
+    for (auto& element : recorded) {
+        DocumentElement* found = doc.findElement(element.id);
+        DocumentElement* parent = doc.findParent(element.id);
+        check(found != nullptr, "restored element found by ID");
+        check(!found || found->getType() == element.type, "ID resolves to an element of the recorded type");
+        check(element.parentId ? parent && parent->getId() == element.parentId : !parent, "restored element has its recorded parent");
+    }
+    auto restored = collectElements(root);
+    check(restored.size() == recorded.size(), "restore brings back every element");
+}
+
+// A copy whose children were never expanded shares them with its source;
+// whatever order the restored tree is visited in, the source's children keep
+// their IDs and the copy's get new ones
+void testRestoredCopyGetsNewIds() {
+    for (bool copyFirst : { false, true }) {
+        Document doc;
+        Section* root = doc.getRootSection();
+        root->add(makeChapter("Original"));
+        Section* original = elementCast<Section>(root->getChildren()[0].get());
+        std::vector<uint64_t> originalIds;
+        for (auto& [element, parentId] : collectElements(original)) originalIds.push_back(element->getId());
+        root->insert(copyFirst ? 0 : 1, original->clone());
+        DocumentMemento memento = doc.createMemento();
+
+        doc.restoreMemento(memento);
+        Section* restoredOriginal = elementCast<Section>(root->getChildren()[copyFirst ? 1 : 0].get());
+        Section* restoredCopy = elementCast<Section>(root->getChildren()[copyFirst ? 0 : 1].get());
+        for (auto& [element, parentId] : collectElements(restoredCopy)) {
+            check(doc.findElement(element->getId()) == element, "copy's elements have IDs of their own");
+        }
+        std::vector<uint64_t> restoredIds;
+        for (auto& [element, parentId] : collectElements(restoredOriginal)) restoredIds.push_back(element->getId());
+        check(restoredIds == originalIds, "source section keeps its IDs after restore");
+        check(doc.indexedElementCount() == collectElements(root).size(), "no two restored elements share an ID");
+    }
+}
+
+// Commands recorded before a restore stay in the history while the
+// elements they work on exist again; the others are dropped
+void testHistoryAfterRestore() {
+    Document doc;
+    CommandHistory history;
+    Section* root = doc.getRootSection();
+    auto first = std::make_unique<Paragraph>("First paragraph");
+    uint64_t firstId = first->getId();
+    history.executeCommand(std::make_unique<AddElementCommand>(&doc, std::move(first)));
+    FormatHandle heading = CharacterFormatFactory::internQuiet("Arial", 18, "Black");
+    history.executeCommand(std::make_unique<FormatCommand>(&doc, doc.findElementAs<Paragraph>(firstId), heading));
+    DocumentMemento memento = doc.createMemento();
+    history.executeCommand(std::make_unique<AddElementCommand>(&doc, std::make_unique<Paragraph>("Added after the checkpoint")));
+
+    doc.restoreMemento(memento);
+    history.undo();
+    check(history.undoCount() == 1, "command for an element the restore removed is dropped");
+    Paragraph* restored = doc.findElementAs<Paragraph>(firstId);
+    check(restored && restored->getFormatHandle() == kNoFormat, "format command applies to the restored paragraph");
+    history.undo();
+    check(root->getChildren().empty() && !doc.findElement(firstId), "add command removes the restored paragraph");
+    history.redo();
+    check(doc.findElement(firstId) && root->getChildren().size() == 1, "redo puts the paragraph back");
+
+    // The restore brings back the paragraph the history holds detached
+    DocumentMemento beforeRemove = doc.createMemento();
+    history.executeCommand(std::make_unique<RemoveElementCommand>(&doc, root, 0));
+    doc.restoreMemento(beforeRemove);
+    history.undo();
+    check(history.undoCount() == 0, "remove command holding a restored element is dropped");
+    check(root->getChildren().empty() && doc.indexedElementCount() == 1, "undo reaches the add command instead");
+}
+
+// The flat copy is shared while the document is unchanged and rebuilt
+// after any edit, however deep
+void testFlatStoreReuse() {
+    Document doc;
+    doc.getRootSection()->add(makeChapter("Chapter 1"));
+    auto first = doc.flatStore();
+    check(doc.flatStore() == first, "unchanged document reuses its flat copy");
+    Section* chapter = elementCast<Section>(doc.getRootSection()->getChildren()[0].get());
+    Section* inner = elementCast<Section>(chapter->getChildren()[2].get());
+    int before = first->countElements();
+    doc.insertText(elementCast<Paragraph>(inner->getChildren()[0].get()), 0, "More ");
+    check(doc.flatStore() != first, "text edit rebuilds the flat copy");
+    inner->add(std::make_unique<Paragraph>("Appended"));
+    check(doc.flatStore()->countElements() == before + 1, "rebuilt copy sees a nested insert");
+}
+
+// Visiting the variant copy produces the same XML as visiting the tree,
+// section names included
+void testVariantVisitMatchesTree() {
+    Document doc;
+    doc.getRootSection()->add(makeChapter("Chapter <1>"));
+    doc.getRootSection()->add(std::make_unique<Section>(""));
+    XMLExportVisitor fromTree;
+    doc.getRootSection()->accept(&fromTree);
+    VariantDocument variant(*doc.getRootSection());
+    XMLExportVisitor fromVariant;
+    variant.accept(&fromVariant);
+    check(fromVariant.getXML() == fromTree.getXML(), "variant document exports the same XML as the tree");
+}
+
+// An XML import, like a binary load, builds the document into its arena
+void testXmlImportUsesArena() {
+    Document doc;
+    doc.getRootSection()->add(makeChapter("Chapter 1"));
+    XMLExportVisitor exporter;
+    doc.getRootSection()->accept(&exporter);
+    std::string xml = exporter.getXML();
+    int fds[2];
+    if (pipe(fds) != 0) {
+        check(false, "pipe for the XML import");
+        return;
+    }
+    bool written = write(fds[1], xml.data(), xml.size()) == static_cast<ssize_t>(xml.size());
+    close(fds[1]);
+    FileManagerFacade facade;
+    auto loaded = written ? facade.loadXml(fds[0]) : nullptr;
+    close(fds[0]);
+    check(loaded != nullptr, "XML import succeeds");
+    if (!loaded) return;
+    check(loaded->getArena() && loaded->getArena()->bytesReserved() > 0, "XML import allocates from the document's arena");
+    XMLExportVisitor reexport;
+    loaded->getRootSection()->accept(&reexport);
+    check(reexport.getXML() == xml, "XML import round-trips");
+}
+
+// Character references to NUL or a surrogate are rejected like any other
+// bad entity; their neighbours decode
+void testXmlCharacterReferences() {
+    auto parses = [](const std::string& text) {
+        std::string xml = "<document><paragraph>" + text + "</paragraph></document>";
+        XmlSaxReader reader(xml.data(), xml.size());
+        Document doc;
+        DocumentXmlBuilder builder(&doc);
+        return reader.parse(builder);
+    };
+    check(!parses("&#0;") && !parses("&#x0;"), "NUL character reference is malformed");
+    check(!parses("&#xD800;") && !parses("&#xDFFF;") && !parses("&#55296;"), "surrogate character reference is malformed");
+    check(parses("&#x1;") && parses("&#xD7FF;") && parses("&#xE000;") && parses("&#x10FFFF;"), "code points around the rejected ranges decode");
+}
+
+}
+
+int main() {
+    testLookupsAfterRestore();
+    testRestoredCopyGetsNewIds();
+    testHistoryAfterRestore();
+    testFlatStoreReuse();
+    testVariantVisitMatchesTree();
+    testXmlImportUsesArena();
+    testXmlCharacterReferences();
+    if (failures) {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}
@@ -2,11 +2,54 @@
 #include <vector>
 #include <string>
 #include <memory>
-#include <stack>
 #include <map>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+#include <variant>
+#include <iterator>
+#include <atomic>
+#include <cstddef>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <unordered_map>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <exception>
+#include <stdexcept>
+#include <functional>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
+
+// Vector kernels: SSE2 is the x86-64 baseline; AVX2 is compiled per function
+// and chosen at runtime where the compiler supports target attributes
+#if defined(__SSE2__) || defined(_M_X64)
+#define DOCUMENT_EDITOR_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define DOCUMENT_EDITOR_AVX2 1
+#endif
+#endif
+
+#if defined(_WIN32)
+// Memory mapping falls back to a buffered read on Windows
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Forward declarations
 class Document;
@@ -61,405 +104,3413 @@ public:
 // STRUCTURAL PATTERNS - Base Classes
 // ==========================================================
 
+// [BRIDGE] - Output Sinks
+// Renderers append into a sink without building temporary strings. Bytes
+// collect in a reusable buffer and are drained to the target only when it
+// fills up or on flush(). A zero-sized buffer writes straight through.
+class OutputSink {
+private:
+    std::vector<char> buffer;
+    size_t used;
+
+protected:
+    virtual void drain(const char* data, size_t length) = 0;
+
+    // Concrete sinks call this from their destructor while drain() is still theirs
+    void flushBuffer() {
+        if (used > 0) {
+            drain(buffer.data(), used);
+            used = 0;
+        }
+    }
+
+public:
+    static constexpr size_t kDefaultBufferSize = 64 * 1024;
+
+    explicit OutputSink(size_t bufferSize) : buffer(bufferSize), used(0) {}
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+    virtual ~OutputSink() = default;
+
+    void append(const char* data, size_t length) {
+        if (length == 0) return;
+        if (length > buffer.size() - used) {
+            flushBuffer();
+            if (length >= buffer.size()) {
+                drain(data, length);
+                return;
+            }
+        }
+        std::memcpy(buffer.data() + used, data, length);
+        used += length;
+    }
+
+    void append(const std::string& text) { append(text.data(), text.size()); }
+    void append(const char* text) { append(text, std::strlen(text)); }
+    void append(char c) { append(&c, 1); }
+
+    void append(long long value) {
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        char* p = end;
+        unsigned long long magnitude = value < 0 ? 0ull - static_cast<unsigned long long>(value)
+            : static_cast<unsigned long long>(value);
+        do {
+            *--p = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (value < 0) *--p = '-';
+        append(p, static_cast<size_t>(end - p));
+    }
+    void append(int value) { append(static_cast<long long>(value)); }
+
+    virtual void flush() { flushBuffer(); }
+};
+
+// Writes through to a std::ostream, whose own buffer keeps output ordered
+// with anything else written to the same stream (e.g. std::cout logging)
+class StreamSink : public OutputSink {
+private:
+    std::ostream& stream;
+protected:
+    void drain(const char* data, size_t length) override {
+        stream.write(data, static_cast<std::streamsize>(length));
+    }
+public:
+    explicit StreamSink(std::ostream& out) : OutputSink(0), stream(out) {}
+
+    void flush() override { stream.flush(); }
+};
+
+// Collects output in memory
+class MemorySink : public OutputSink {
+private:
+    std::string output;
+protected:
+    void drain(const char* data, size_t length) override { output.append(data, length); }
+public:
+    MemorySink() : OutputSink(0) {}
+
+    const std::string& str() const { return output; }
+    size_t size() const { return output.size(); }
+    void clear() { output.clear(); }
+};
+
+// Buffered writes to a C stream
+class FileSink : public OutputSink {
+private:
+    std::FILE* file;
+protected:
+    void drain(const char* data, size_t length) override { std::fwrite(data, 1, length, file); }
+public:
+    explicit FileSink(std::FILE* f, size_t bufferSize = kDefaultBufferSize)
+        : OutputSink(bufferSize), file(f) {
+    }
+    ~FileSink() override { flushBuffer(); }
+
+    void flush() override {
+        flushBuffer();
+        std::fflush(file);
+    }
+};
+
+// Buffered writes to a file descriptor
+class FdSink : public OutputSink {
+private:
+    int fd;
+protected:
+    void drain(const char* data, size_t length) override {
+        while (length > 0) {
+#if defined(_WIN32)
+            int written = ::_write(fd, data, static_cast<unsigned>(std::min<size_t>(length, 1u << 30)));
+            if (written <= 0) return;
+#else
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return;
+#endif
+            data += written;
+            length -= static_cast<size_t>(written);
+        }
+    }
+public:
+    explicit FdSink(int descriptor, size_t bufferSize = kDefaultBufferSize)
+        : OutputSink(bufferSize), fd(descriptor) {
+    }
+    ~FdSink() override { flushBuffer(); }
+};
+
+// Small integer naming an interned CharacterFormat; 0 means no format
+using FormatHandle = uint32_t;
+static constexpr FormatHandle kNoFormat = 0;
+
+// Run-length formatting inside a paragraph: characters in
+// [offset, offset + length) use the run's format and style bits. Runs are
+// sorted, disjoint and non-empty; uncovered text uses the paragraph format.
+struct StyleRun {
+    enum : uint8_t { Bold = 1, Italic = 2 };
+
+    uint32_t offset;
+    uint32_t length;
+    FormatHandle format;
+    uint8_t styles;
+
+    uint32_t end() const { return offset + length; }
+    bool sameStyle(const StyleRun& other) const { return format == other.format && styles == other.styles; }
+};
+
+using StyleRuns = std::vector<StyleRun>;
+
+// Calls fn(offset, length, run) for consecutive segments of a text of the
+// given length; run is null where no run applies
+template <typename F>
+void forEachStyledSegment(size_t textLength, const StyleRuns& runs, F fn) {
+    size_t pos = 0;
+    for (const StyleRun& run : runs) {
+        size_t start = std::min<size_t>(std::max<size_t>(run.offset, pos), textLength);
+        size_t end = std::min<size_t>(run.end(), textLength);
+        if (start > pos) fn(pos, start - pos, static_cast<const StyleRun*>(nullptr));
+        if (end > start) fn(start, end - start, &run);
+        pos = std::max(pos, end);
+    }
+    if (pos < textLength) fn(pos, textLength - pos, static_cast<const StyleRun*>(nullptr));
+}
+
+// Read-only text handed out in pieces, in order. Paragraphs pass their piece
+// table, so renderers can stream a long paragraph without flattening it.
+class TextSource {
+public:
+    using ChunkFn = std::function<void(const char*, size_t)>;
+
+    virtual size_t length() const = 0;
+    // Calls fn(data, length) for the bytes of [offset, offset + count)
+    virtual void read(size_t offset, size_t count, const ChunkFn& fn) const = 0;
+
+    std::string copy() const {
+        std::string text;
+        text.reserve(length());
+        read(0, length(), [&](const char* data, size_t n) { text.append(data, n); });
+        return text;
+    }
+
+protected:
+    ~TextSource() = default;
+};
+
+// TextSource over a string the caller keeps alive
+class StringSource final : public TextSource {
+private:
+    const std::string& text;
+public:
+    explicit StringSource(const std::string& s) : text(s) {}
+
+    size_t length() const override { return text.size(); }
+    void read(size_t offset, size_t count, const ChunkFn& fn) const override {
+        offset = std::min(offset, text.size());
+        count = std::min(count, text.size() - offset);
+        if (count > 0) fn(text.data() + offset, count);
+    }
+};
+
 // [BRIDGE] - Renderer Interface
 class IRenderer {
 public:
     virtual void renderText(const std::string& text, bool bold = false, bool italic = false) = 0;
+    // Paragraph text with inline runs; renderers without inline styling
+    // draw the plain text
+    virtual void renderRuns(const std::string& text, const StyleRuns& runs) { renderText(text); }
+    // Paragraph text read straight from its storage. Renderers that stream
+    // override these; the defaults copy the text into one string.
+    virtual void renderPieces(const TextSource& text, bool bold = false, bool italic = false) {
+        renderText(text.copy(), bold, italic);
+    }
+    virtual void renderStyledPieces(const TextSource& text, const StyleRuns& runs) {
+        renderRuns(text.copy(), runs);
+    }
     virtual void renderImage(const std::string& path) = 0;
     virtual void renderTable(int rows, int cols) = 0;
     virtual void startSection() = 0;
     virtual void endSection() = 0;
+
+    // Pushes buffered output to its destination
+    virtual void flush() {}
+
+    // Parallel rendering support: a renderer that exposes its sink and can
+    // produce an equivalent renderer for another sink lets subtrees render
+    // concurrently into private buffers. Others are drawn serially.
+    virtual OutputSink* getSink() { return nullptr; }
+    virtual std::unique_ptr<IRenderer> createForSink(OutputSink& sink) const { return nullptr; }
+
     virtual ~IRenderer() = default;
 };
 
+// Renderers write to std::cout unless given a sink
 class ConsoleRenderer : public IRenderer {
+private:
+    std::unique_ptr<OutputSink> ownedSink;
+    OutputSink* sink;
+
+    void write(const TextSource& text, size_t offset, size_t length) {
+        OutputSink* out = sink;
+        text.read(offset, length, [out](const char* data, size_t n) { out->append(data, n); });
+    }
 public:
+    ConsoleRenderer() : ownedSink(std::make_unique<StreamSink>(std::cout)), sink(ownedSink.get()) {}
+    explicit ConsoleRenderer(OutputSink& out) : sink(&out) {}
+
     void renderText(const std::string& text, bool bold, bool italic) override {
-        std::string prefix = "";
-        if (bold) prefix += "[BOLD]";
-        if (italic) prefix += "[ITALIC]";
-        std::cout << prefix << " " << text << std::endl;
+        renderPieces(StringSource(text), bold, italic);
+    }
+    void renderRuns(const std::string& text, const StyleRuns& runs) override {
+        renderStyledPieces(StringSource(text), runs);
+    }
+    void renderPieces(const TextSource& text, bool bold, bool italic) override {
+        if (bold) sink->append("[BOLD]");
+        if (italic) sink->append("[ITALIC]");
+        sink->append(' ');
+        write(text, 0, text.length());
+        sink->append('\n');
+    }
+    void renderStyledPieces(const TextSource& text, const StyleRuns& runs) override {
+        sink->append(' ');
+        forEachStyledSegment(text.length(), runs, [&](size_t offset, size_t length, const StyleRun* run) {
+            bool bold = run && (run->styles & StyleRun::Bold);
+            bool italic = run && (run->styles & StyleRun::Italic);
+            if (bold) sink->append("[BOLD]");
+            if (italic) sink->append("[ITALIC]");
+            write(text, offset, length);
+            if (italic) sink->append("[/ITALIC]");
+            if (bold) sink->append("[/BOLD]");
+        });
+        sink->append('\n');
     }
     void renderImage(const std::string& path) override {
-        std::cout << "[IMAGE: " << path << "]" << std::endl;
+        sink->append("[IMAGE: ");
+        sink->append(path);
+        sink->append("]\n");
     }
     void renderTable(int rows, int cols) override {
-        std::cout << "[TABLE: " << rows << "x" << cols << "]" << std::endl;
+        sink->append("[TABLE: ");
+        sink->append(rows);
+        sink->append('x');
+        sink->append(cols);
+        sink->append("]\n");
+    }
+    void startSection() override { sink->append("--- Section Start ---\n"); }
+    void endSection() override { sink->append("--- Section End ---\n"); }
+    void flush() override { sink->flush(); }
+
+    OutputSink* getSink() override { return sink; }
+    std::unique_ptr<IRenderer> createForSink(OutputSink& out) const override {
+        return std::make_unique<ConsoleRenderer>(out);
     }
-    void startSection() override { std::cout << "--- Section Start ---\n"; }
-    void endSection() override { std::cout << "--- Section End ---\n"; }
 };
 
 class HTMLRenderer : public IRenderer {
+private:
+    std::unique_ptr<OutputSink> ownedSink;
+    OutputSink* sink;
+
+    void write(const TextSource& text, size_t offset, size_t length) {
+        OutputSink* out = sink;
+        text.read(offset, length, [out](const char* data, size_t n) { out->append(data, n); });
+    }
 public:
+    HTMLRenderer() : ownedSink(std::make_unique<StreamSink>(std::cout)), sink(ownedSink.get()) {}
+    explicit HTMLRenderer(OutputSink& out) : sink(&out) {}
+
     void renderText(const std::string& text, bool bold, bool italic) override {
-        std::string html = text;
-        if (bold) html = "<strong>" + html + "</strong>";
-        if (italic) html = "<em>" + html + "</em>";
-        std::cout << "<p>" << html << "</p>\n";
+        renderPieces(StringSource(text), bold, italic);
+    }
+    void renderRuns(const std::string& text, const StyleRuns& runs) override {
+        renderStyledPieces(StringSource(text), runs);
     }
+    void renderPieces(const TextSource& text, bool bold, bool italic) override {
+        sink->append("<p>");
+        if (italic) sink->append("<em>");
+        if (bold) sink->append("<strong>");
+        write(text, 0, text.length());
+        if (bold) sink->append("</strong>");
+        if (italic) sink->append("</em>");
+        sink->append("</p>\n");
+    }
+    void renderStyledPieces(const TextSource& text, const StyleRuns& runs) override;
     void renderImage(const std::string& path) override {
-        std::cout << "<img src=\"" << path << "\" />\n";
+        sink->append("<img src=\"");
+        sink->append(path);
+        sink->append("\" />\n");
     }
     void renderTable(int rows, int cols) override {
-        std::cout << "<table data-rows=\"" << rows << "\" data-cols=\"" << cols << "\"></table>\n";
+        sink->append("<table data-rows=\"");
+        sink->append(rows);
+        sink->append("\" data-cols=\"");
+        sink->append(cols);
+        sink->append("\"></table>\n");
     }
-    void startSection() override { std::cout << "<section>\n"; }
-    void endSection() override { std::cout << "</section>\n"; }
-};
+    void startSection() override { sink->append("<section>\n"); }
+    void endSection() override { sink->append("</section>\n"); }
+    void flush() override { sink->flush(); }
 
-// [COMPOSITE] & [PROTOTYPE] - Document Element Base
-class DocumentElement {
-public:
-    virtual void draw(IRenderer* renderer) = 0;
-    virtual std::unique_ptr<DocumentElement> clone() const = 0;
-    virtual void accept(class IDocumentVisitor* visitor) = 0;
-    virtual std::string getType() const = 0;
-    virtual ~DocumentElement() = default;
+    OutputSink* getSink() override { return sink; }
+    std::unique_ptr<IRenderer> createForSink(OutputSink& out) const override {
+        return std::make_unique<HTMLRenderer>(out);
+    }
 };
 
-// [FLYWEIGHT] - Character Formatting (shared properties)
-class CharacterFormat {
+// Fixed-size worker pool. Tasks run in submission order as workers free up;
+// the destructor finishes queued work before joining.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping;
+
+    void work() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
 public:
-    std::string fontName;
-    int fontSize;
-    std::string color;
+    explicit ThreadPool(size_t threadCount = std::thread::hardware_concurrency()) : stopping(false) {
+        threadCount = std::max<size_t>(threadCount, 1);
+        for (size_t i = 0; i < threadCount; ++i) workers.emplace_back([this] { work(); });
+    }
 
-    CharacterFormat(std::string font, int size, std::string col)
-        : fontName(font), fontSize(size), color(col) {
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Exceptions thrown by the task surface from the returned future
+    template <typename F>
+    auto submit(F fn) -> std::future<decltype(fn())> {
+        using Result = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+        std::future<Result> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([task] { (*task)(); });
+        }
+        ready.notify_one();
+        return result;
     }
+
+    size_t size() const { return workers.size(); }
 };
 
-class CharacterFormatFactory {
+// [ARENA] - Monotonic Allocator for Document Elements
+// Elements created while a Scope is active are carved out of large blocks
+// instead of individual heap allocations. Freeing an element is a no-op;
+// the blocks are returned in one go once the owner and every element
+// allocated from the arena are gone.
+class ElementArena {
 private:
-    std::map<std::string, std::shared_ptr<CharacterFormat>> formats;
-
-    std::string getKey(const std::string& font, int size, const std::string& color) {
-        return font + "_" + std::to_string(size) + "_" + color;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* cursor;
+    size_t remaining;
+    size_t blockSize;
+    size_t reserved;
+    std::atomic<size_t> refs;  // Owner + live elements
+
+    static ElementArena*& current() {
+        thread_local ElementArena* active = nullptr;
+        return active;
     }
-public:
-    std::shared_ptr<CharacterFormat> getFormat(const std::string& font, int size, const std::string& color) {
-        std::string key = getKey(font, size, color);
-        if (formats.find(key) == formats.end()) {
-            formats[key] = std::make_shared<CharacterFormat>(font, size, color);
-            std::cout << "[Flyweight] Created new format: " << key << std::endl;
-        }
-        return formats[key];
+
+    ~ElementArena() = default;
+
+    void unref() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
     }
-};
 
-// Concrete Elements
-class Paragraph : public DocumentElement {
-protected:
-    std::string content;
-    std::shared_ptr<CharacterFormat> format;
 public:
-    Paragraph(std::string text, std::shared_ptr<CharacterFormat> fmt = nullptr)
-        : content(text), format(fmt) {
+    static constexpr size_t kDefaultBlockSize = 1 << 20;
+    static constexpr size_t kHeaderSize = alignof(std::max_align_t);
+
+    explicit ElementArena(size_t blockBytes = kDefaultBlockSize)
+        : cursor(nullptr), remaining(0), blockSize(blockBytes), reserved(0), refs(1) {
+    }
+    ElementArena(const ElementArena&) = delete;
+    ElementArena& operator=(const ElementArena&) = delete;
+
+    // RAII guard that routes element allocations on this thread to an arena
+    class Scope {
+    private:
+        ElementArena* previous;
+    public:
+        explicit Scope(ElementArena* arena) : previous(current()) { current() = arena; }
+        ~Scope() { current() = previous; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // Every allocation carries a header naming its arena (nullptr for heap)
+    static void* allocate(size_t size) {
+        ElementArena* arena = current();
+        size_t total = kHeaderSize + ((size + kHeaderSize - 1) & ~(kHeaderSize - 1));
+        char* raw = arena ? arena->carve(total) : static_cast<char*>(::operator new(total));
+        *reinterpret_cast<ElementArena**>(raw) = arena;
+        return raw + kHeaderSize;
     }
 
-    void draw(IRenderer* renderer) override {
-        renderer->renderText(content);
+    static void deallocate(void* ptr) {
+        if (!ptr) return;
+        char* raw = static_cast<char*>(ptr) - kHeaderSize;
+        ElementArena* arena = *reinterpret_cast<ElementArena**>(raw);
+        if (arena) arena->unref();
+        else ::operator delete(raw);
     }
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        return std::make_unique<Paragraph>(*this);
+    // Called by the owner; blocks are freed when the last element dies too
+    void release() { unref(); }
+
+    size_t bytesReserved() const { return reserved; }
+
+private:
+    char* carve(size_t bytes) {
+        if (bytes > remaining) {
+            size_t size = std::max(blockSize, bytes);
+            blocks.push_back(std::unique_ptr<char[]>(new char[size]));
+            cursor = blocks.back().get();
+            remaining = size;
+            reserved += size;
+        }
+        char* result = cursor;
+        cursor += bytes;
+        remaining -= bytes;
+        refs.fetch_add(1, std::memory_order_relaxed);
+        return result;
     }
+};
 
-    void accept(class IDocumentVisitor* visitor) override;
+// Standard allocator over ElementArena, for state that elements share
+// through shared_ptr (piece table blocks and nodes). Any instance frees any
+// allocation, since each one names its own arena.
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
 
-    std::string getType() const override { return "Paragraph"; }
-    std::string getContent() const { return content; }
+    ArenaAllocator() = default;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(ElementArena::allocate(n * sizeof(T))); }
+    void deallocate(T* ptr, size_t) { ElementArena::deallocate(ptr); }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>&) const { return false; }
 };
 
-class Image : public DocumentElement {
-protected:
-    std::string imagePath;
-public:
-    Image(std::string path) : imagePath(path) {}
+// Concrete element class, stored in every element so type tests are a single
+// byte compare. Opaque covers classes outside the built-in set.
+enum class ElementKind : uint8_t {
+    Paragraph, Image, Table, Section, ImageProxy, Bold, Italic, Shape, Opaque
+};
 
-    void draw(IRenderer* renderer) override {
-        renderer->renderImage(imagePath);
+inline const char* elementKindName(ElementKind kind) {
+    switch (kind) {
+    case ElementKind::Paragraph: return "Paragraph";
+    case ElementKind::Image: return "Image";
+    case ElementKind::Table: return "Table";
+    case ElementKind::Section: return "Section";
+    case ElementKind::ImageProxy: return "ImageProxy";
+    case ElementKind::Bold: return "Bold";
+    case ElementKind::Italic: return "Italic";
+    case ElementKind::Shape: return "Shape";
+    case ElementKind::Opaque: break;
     }
+    return "Opaque";
+}
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        return std::make_unique<Image>(*this);
+struct SnapshotNode;
+using SnapshotPtr = std::shared_ptr<const SnapshotNode>;
+class ElementIndex;
+
+// [COMPOSITE] & [PROTOTYPE] - Document Element Base
+class DocumentElement {
+private:
+    DocumentElement* parent;       // Owning section or decorator
+    uint64_t id;                   // Unique within a document; clones get their own, restores keep theirs
+    uint64_t version;              // Bumped on every change in this subtree
+    mutable SnapshotPtr snapshotCache;
+    mutable uint64_t snapshotVersion;
+    ElementKind kind;              // Fixed at construction
+
+    static uint64_t nextVersion() {
+        static std::atomic<uint64_t> clock{ 0 };
+        return clock.fetch_add(1, std::memory_order_relaxed) + 1;
     }
 
-    void accept(class IDocumentVisitor* visitor) override;
+    static uint64_t nextId() {
+        static std::atomic<uint64_t> counter{ 0 };
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
 
-    std::string getType() const override { return "Image"; }
-    std::string getPath() const { return imagePath; }
-};
+    friend class Section;
+    friend class TextDecorator;
+    friend std::unique_ptr<DocumentElement> materializeSnapshot(const SnapshotPtr& node, const ElementIndex* ids);
 
-class Table : public DocumentElement {
 protected:
-    int rows, cols;
+    // Stamps this element and every ancestor as changed: O(depth)
+    void touch() {
+        uint64_t stamp = nextVersion();
+        for (DocumentElement* e = this; e; e = e->parent) e->version = stamp;
+    }
+
+    // Builds an immutable snapshot; children reuse their own cached snapshots
+    virtual SnapshotPtr makeSnapshot() const;
+
 public:
-    Table(int r, int c) : rows(r), cols(c) {}
+    static void* operator new(size_t size) { return ElementArena::allocate(size); }
+    static void operator delete(void* ptr) { ElementArena::deallocate(ptr); }
 
-    void draw(IRenderer* renderer) override {
-        renderer->renderTable(rows, cols);
+    explicit DocumentElement(ElementKind k = ElementKind::Opaque)
+        : parent(nullptr), id(nextId()), version(nextVersion()), snapshotVersion(0), kind(k) {
     }
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        return std::make_unique<Table>(*this);
+    // Copies start detached with a new ID, so the source's cached snapshot,
+    // which records its ID, is not carried over
+    DocumentElement(const DocumentElement& other)
+        : parent(nullptr), id(nextId()), version(other.version), snapshotVersion(0), kind(other.kind) {
     }
+    DocumentElement& operator=(const DocumentElement&) = delete;
 
-    void accept(class IDocumentVisitor* visitor) override;
+    virtual void draw(IRenderer* renderer) = 0;
+    virtual std::unique_ptr<DocumentElement> clone() const = 0;
+    virtual void accept(class IDocumentVisitor* visitor) = 0;
+    virtual std::string getType() const = 0;
+    virtual ~DocumentElement() = default;
 
-    std::string getType() const override { return "Table"; }
+    DocumentElement* getParent() const { return parent; }
+    uint64_t getId() const { return id; }
+    uint64_t getVersion() const { return version; }
+    ElementKind getKind() const { return kind; }
+
+    // Persistent snapshot of this subtree. Unchanged subtrees return their
+    // cached node, so after an edit only the path to the root is rebuilt.
+    SnapshotPtr snapshot() const {
+        if (!snapshotCache || snapshotVersion != version) {
+            snapshotCache = makeSnapshot();
+            snapshotVersion = version;
+        }
+        return snapshotCache;
+    }
 };
 
-// [COMPOSITE] - Section that contains elements
-class Section : public DocumentElement {
-protected:
-    std::vector<std::unique_ptr<DocumentElement>> children;
-    std::string sectionName;
+// Checked downcast through the kind tag instead of RTTI. T::classof says
+// which kinds are instances of T.
+template <typename T>
+T* elementCast(DocumentElement* element) {
+    return element && T::classof(element->getKind()) ? static_cast<T*>(element) : nullptr;
+}
+
+template <typename T>
+const T* elementCast(const DocumentElement* element) {
+    return element && T::classof(element->getKind()) ? static_cast<const T*>(element) : nullptr;
+}
+
+// [FLYWEIGHT] - Character Formatting (shared properties)
+class CharacterFormat {
 public:
-    Section(std::string name = "") : sectionName(name) {}
+    std::string fontName;
+    int fontSize;
+    std::string color;
 
-    void add(std::unique_ptr<DocumentElement> el) {
-        children.push_back(std::move(el));
+    CharacterFormat() : fontSize(0) {}
+    CharacterFormat(std::string font, int size, std::string col)
+        : fontName(font), fontSize(size), color(col) {
     }
+};
 
-    void draw(IRenderer* renderer) override {
-        renderer->startSection();
-        for (auto& child : children) child->draw(renderer);
-        renderer->endSection();
+// Process-wide intern table keyed on (font, size, color). Lookups hash the
+// key once and probe one of kShards independently locked open-addressing
+// tables, so threads interning different formats rarely contend and a hit
+// allocates nothing. Formats live in fixed-size chunks that never move, so
+// resolving a handle takes no lock. Each shard holds kMaxChunks * kChunkSize
+// formats; interning past that throws std::length_error rather than hand
+// out a handle that would silently drop the format.
+class CharacterFormatFactory {
+private:
+    static constexpr uint32_t kShardBits = 4;
+    static constexpr uint32_t kShards = 1u << kShardBits;
+    static constexpr uint32_t kChunkBits = 8;
+    static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+    static constexpr uint32_t kMaxChunks = 256;
+
+    struct Shard {
+        std::mutex mutex;
+        std::vector<uint32_t> slots;  // 1-based format index, 0 for empty
+        std::vector<size_t> hashes;   // Per format, to skip field compares
+        uint32_t count = 0;
+        std::unique_ptr<CharacterFormat[]> chunkStorage[kMaxChunks];
+        std::atomic<CharacterFormat*> chunks[kMaxChunks] = {};
+    };
+
+    static Shard* shards() {
+        static Shard table[kShards];
+        return table;
     }
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        auto newSection = std::make_unique<Section>(sectionName);
-        for (auto& child : children) {
-            newSection->add(child->clone());
-        }
-        return newSection;
+    static size_t hashKey(const std::string& font, int size, const std::string& color) {
+        std::hash<std::string> hashString;
+        size_t h = hashString(font);
+        h ^= hashString(color) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        h ^= static_cast<size_t>(size) * 0xff51afd7ed558ccdull + (h << 6) + (h >> 2);
+        return h;
     }
 
-    void accept(class IDocumentVisitor* visitor) override;
+    static CharacterFormat& at(Shard& shard, uint32_t index) {
+        return shard.chunks[index >> kChunkBits].load(std::memory_order_acquire)[index & (kChunkSize - 1)];
+    }
 
-    std::string getType() const override { return "Section"; }
+    static void grow(Shard& shard) {
+        std::vector<uint32_t> slots(shard.slots.empty() ? 16 : shard.slots.size() * 2, 0);
+        size_t mask = slots.size() - 1;
+        for (uint32_t slot : shard.slots) {
+            if (!slot) continue;
+            size_t i = (shard.hashes[slot - 1] >> kShardBits) & mask;
+            while (slots[i]) i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+        shard.slots.swap(slots);
+    }
 
-    const std::vector<std::unique_ptr<DocumentElement>>& getChildren() const {
-        return children;
+    // Returns the handle and whether this call created the format
+    static std::pair<FormatHandle, bool> intern(const std::string& font, int size, const std::string& color) {
+        size_t h = hashKey(font, size, color);
+        uint32_t shardIndex = static_cast<uint32_t>(h & (kShards - 1));
+        Shard& shard = shards()[shardIndex];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if ((shard.count + 1) * 4 > shard.slots.size() * 3) grow(shard);
+        size_t mask = shard.slots.size() - 1;
+        size_t i = (h >> kShardBits) & mask;
+        for (; shard.slots[i]; i = (i + 1) & mask) {
+            uint32_t index = shard.slots[i] - 1;
+            if (shard.hashes[index] != h) continue;
+            const CharacterFormat& existing = at(shard, index);
+            if (existing.fontSize == size && existing.fontName == font && existing.color == color) {
+                return { ((index + 1) << kShardBits) | shardIndex, false };
+            }
+        }
+
+        uint32_t index = shard.count;
+        uint32_t chunk = index >> kChunkBits;
+        if (chunk >= kMaxChunks) {
+            throw std::length_error("CharacterFormatFactory: format table shard is full");
+        }
+        if (!shard.chunkStorage[chunk]) {
+            shard.chunkStorage[chunk].reset(new CharacterFormat[kChunkSize]);
+            shard.chunks[chunk].store(shard.chunkStorage[chunk].get(), std::memory_order_release);
+        }
+        CharacterFormat& format = at(shard, index);
+        format.fontName = font;
+        format.fontSize = size;
+        format.color = color;
+        shard.hashes.push_back(h);
+        shard.slots[i] = index + 1;
+        shard.count++;
+        return { ((index + 1) << kShardBits) | shardIndex, true };
     }
-};
 
-// [FACTORY METHOD] - Element Factory
-class ElementFactory {
 public:
-    static std::unique_ptr<DocumentElement> createParagraph(const std::string& text) {
-        return std::make_unique<Paragraph>(text);
+    // Handles are process-wide, so any factory instance resolves any handle
+    FormatHandle getFormatHandle(const std::string& font, int size, const std::string& color) {
+        auto result = intern(font, size, color);
+        if (result.second) {
+            std::cout << "[Flyweight] Created new format: " << font << "_" << size << "_" << color << std::endl;
+        }
+        return result.first;
     }
 
-    static std::unique_ptr<DocumentElement> createImage(const std::string& path) {
-        return std::make_unique<Image>(path);
+    const CharacterFormat* getFormat(const std::string& font, int size, const std::string& color) {
+        return resolve(getFormatHandle(font, size, color));
     }
 
-    static std::unique_ptr<DocumentElement> createTable(int rows, int cols) {
-        return std::make_unique<Table>(rows, cols);
+    // Interns without logging; used when loading documents
+    static FormatHandle internQuiet(const std::string& font, int size, const std::string& color) {
+        return intern(font, size, color).first;
     }
 
-    static std::unique_ptr<DocumentElement> createSection(const std::string& name = "") {
-        return std::make_unique<Section>(name);
+    static const CharacterFormat* resolve(FormatHandle handle) {
+        if (handle == kNoFormat) return nullptr;
+        return &at(shards()[handle & (kShards - 1)], (handle >> kShardBits) - 1);
     }
 };
 
-// [DECORATOR] - Text Formatting Decorators
-class TextDecorator : public DocumentElement {
-protected:
-    std::unique_ptr<DocumentElement> wrappedElement;
-public:
-    TextDecorator(std::unique_ptr<DocumentElement> element)
-        : wrappedElement(std::move(element)) {
+void HTMLRenderer::renderStyledPieces(const TextSource& text, const StyleRuns& runs) {
+    sink->append("<p>");
+    forEachStyledSegment(text.length(), runs, [&](size_t offset, size_t length, const StyleRun* run) {
+        const CharacterFormat* fmt = run ? CharacterFormatFactory::resolve(run->format) : nullptr;
+        bool bold = run && (run->styles & StyleRun::Bold);
+        bool italic = run && (run->styles & StyleRun::Italic);
+        if (fmt) {
+            sink->append("<span style=\"font-family:");
+            sink->append(fmt->fontName);
+            sink->append(";font-size:");
+            sink->append(fmt->fontSize);
+            sink->append("pt;color:");
+            sink->append(fmt->color);
+            sink->append("\">");
+        }
+        if (italic) sink->append("<em>");
+        if (bold) sink->append("<strong>");
+        write(text, offset, length);
+        if (bold) sink->append("</strong>");
+        if (italic) sink->append("</em>");
+        if (fmt) sink->append("</span>");
+    });
+    sink->append("</p>\n");
+}
+
+// [PIECE TABLE] - Paragraph Text Storage
+// The text is a sequence of pieces pointing into immutable byte blocks.
+// Pieces live in a persistent treap indexed by character offset, so
+// insert/erase cost O(log n) and copies share structure. Written bytes never
+// move or change, and a table only appends to a block it allocated itself: a
+// copy starts its own block on its first insert, so copies of one text can be
+// edited on different threads. Each piece keeps its block alive.
+class PieceTable final : public TextSource {
+private:
+    using Block = std::shared_ptr<const char>;
+
+    struct Piece {
+        Block block;
+        const char* data;
+        size_t length;
+    };
+
+    struct Node;
+    using NodePtr = std::shared_ptr<const Node>;
+
+    struct Node {
+        Piece piece;
+        uint32_t priority;
+        size_t subtreeLength;
+        NodePtr left, right;
+    };
+
+    static constexpr size_t kMinBlockSize = 64;
+    static constexpr size_t kMaxBlockSize = 64 * 1024;
+
+    NodePtr root;
+    Block writeBlock;            // Newest block this table allocated; null for copies
+    char* writeCursor;           // Free tail of writeBlock
+    size_t writeRemaining;
+    size_t writeBlockSize;       // Blocks double up to kMaxBlockSize
+    size_t lastInsertEnd;        // Lets consecutive typing extend one piece
+    const char* lastWriteEnd;
+    mutable std::shared_ptr<const std::string> flat;  // Materialized text cache
+
+    static uint32_t nextPriority() {
+        thread_local uint32_t seed = 2463534242u;
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        return seed;
     }
 
-    std::string getType() const override { return wrappedElement->getType(); }
-};
+    // Blocks and nodes come from the active ElementArena, if any
+    static Block allocateBlock(size_t size) {
+        char* bytes = static_cast<char*>(ElementArena::allocate(size));
+        return Block(bytes, [](const char* p) { ElementArena::deallocate(const_cast<char*>(p)); }, ArenaAllocator<char>());
+    }
 
-class BoldDecorator : public TextDecorator {
-public:
-    BoldDecorator(std::unique_ptr<DocumentElement> element)
-        : TextDecorator(std::move(element)) {
+    static size_t lengthOf(const NodePtr& n) { return n ? n->subtreeLength : 0; }
+
+    static NodePtr make(const Piece& p, uint32_t priority, NodePtr l, NodePtr r) {
+        size_t len = lengthOf(l) + p.length + lengthOf(r);
+        return std::allocate_shared<Node>(ArenaAllocator<Node>(), Node{ p, priority, len, std::move(l), std::move(r) });
     }
 
-    void draw(IRenderer* renderer) override {
-        // Simplified: just render with bold flag
-        if (auto* para = dynamic_cast<Paragraph*>(wrappedElement.get())) {
-            renderer->renderText(para->getContent(), true, false);
+    static NodePtr leaf(const Piece& p) { return make(p, nextPriority(), nullptr, nullptr); }
+
+    static NodePtr merge(const NodePtr& a, const NodePtr& b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (a->priority > b->priority) return make(a->piece, a->priority, a->left, merge(a->right, b));
+        return make(b->piece, b->priority, merge(a, b->left), b->right);
+    }
+
+    // Splits into [0, offset) and [offset, end), cutting a piece if needed
+    static std::pair<NodePtr, NodePtr> split(const NodePtr& n, size_t offset) {
+        if (!n) return { nullptr, nullptr };
+        size_t leftLen = lengthOf(n->left);
+        if (offset <= leftLen) {
+            auto parts = split(n->left, offset);
+            return { parts.first, make(n->piece, n->priority, parts.second, n->right) };
         }
-        else {
-            wrappedElement->draw(renderer);
+        size_t pieceEnd = leftLen + n->piece.length;
+        if (offset >= pieceEnd) {
+            auto parts = split(n->right, offset - pieceEnd);
+            return { make(n->piece, n->priority, n->left, parts.first), parts.second };
         }
+        size_t cut = offset - leftLen;
+        Piece head{ n->piece.block, n->piece.data, cut };
+        Piece tail{ n->piece.block, n->piece.data + cut, n->piece.length - cut };
+        return { merge(n->left, leaf(head)), merge(leaf(tail), n->right) };
     }
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        return std::make_unique<BoldDecorator>(wrappedElement->clone());
+    static NodePtr extendRightmost(const NodePtr& n, size_t extra) {
+        if (n->right) return make(n->piece, n->priority, n->left, extendRightmost(n->right, extra));
+        Piece grown{ n->piece.block, n->piece.data, n->piece.length + extra };
+        return make(grown, n->priority, n->left, nullptr);
     }
 
-    void accept(class IDocumentVisitor* visitor) override {
-        wrappedElement->accept(visitor);
+    template <typename F>
+    static void forEachPiece(const NodePtr& n, F& fn) {
+        if (!n) return;
+        forEachPiece(n->left, fn);
+        fn(n->piece.data, n->piece.length);
+        forEachPiece(n->right, fn);
     }
-};
 
-class ItalicDecorator : public TextDecorator {
-public:
+    // Visits the part of each piece inside [from, to), relative to n's subtree
+    template <typename F>
+    static void forEachPieceIn(const NodePtr& n, size_t from, size_t to, F& fn) {
+        if (!n || from >= to) return;
+        size_t leftLen = lengthOf(n->left);
+        if (from < leftLen) forEachPieceIn(n->left, from, std::min(to, leftLen), fn);
+        size_t pieceEnd = leftLen + n->piece.length;
+        size_t begin = std::max(from, leftLen);
+        size_t end = std::min(to, pieceEnd);
+        if (begin < end) fn(n->piece.data + (begin - leftLen), end - begin);
+        if (to > pieceEnd) forEachPieceIn(n->right, from > pieceEnd ? from - pieceEnd : 0, to - pieceEnd, fn);
+    }
+
+    // Copies text into this table's own block, starting a new one when full
+    const char* write(const std::string& text) {
+        if (!writeCursor || writeRemaining < text.size()) {
+            size_t size = std::max(text.size(), std::min(kMaxBlockSize, std::max(kMinBlockSize, 2 * writeBlockSize)));
+            writeBlock = allocateBlock(size);
+            writeBlockSize = size;
+            writeCursor = const_cast<char*>(writeBlock.get());
+            writeRemaining = size;
+        }
+        char* data = writeCursor;
+        std::memcpy(data, text.data(), text.size());
+        writeCursor += text.size();
+        writeRemaining -= text.size();
+        return data;
+    }
+
+public:
+    explicit PieceTable(const std::string& text = "") : PieceTable(text.data(), text.size()) {}
+
+    PieceTable(const char* text, size_t size)
+        : writeCursor(nullptr), writeRemaining(0), writeBlockSize(0), lastInsertEnd(SIZE_MAX), lastWriteEnd(nullptr) {
+        if (size == 0) return;
+        Block block = allocateBlock(size);
+        std::memcpy(const_cast<char*>(block.get()), text, size);
+        root = leaf(Piece{ block, block.get(), size });
+    }
+
+    // Copies share every block but write new text into blocks of their own
+    PieceTable(const PieceTable& other)
+        : root(other.root), writeCursor(nullptr), writeRemaining(0), writeBlockSize(0),
+        lastInsertEnd(SIZE_MAX), lastWriteEnd(nullptr), flat(other.flat) {
+    }
+
+    PieceTable(PieceTable&& other) noexcept
+        : root(std::move(other.root)), writeBlock(std::move(other.writeBlock)),
+        writeCursor(other.writeCursor), writeRemaining(other.writeRemaining), writeBlockSize(other.writeBlockSize),
+        lastInsertEnd(other.lastInsertEnd), lastWriteEnd(other.lastWriteEnd), flat(std::move(other.flat)) {
+        other.writeCursor = nullptr;
+        other.writeRemaining = 0;
+        other.lastInsertEnd = SIZE_MAX;
+    }
+
+    PieceTable& operator=(const PieceTable& other) {
+        if (this != &other) *this = PieceTable(other);
+        return *this;
+    }
+
+    PieceTable& operator=(PieceTable&& other) noexcept {
+        root = std::move(other.root);
+        writeBlock = std::move(other.writeBlock);
+        writeCursor = other.writeCursor;
+        writeRemaining = other.writeRemaining;
+        writeBlockSize = other.writeBlockSize;
+        lastInsertEnd = other.lastInsertEnd;
+        lastWriteEnd = other.lastWriteEnd;
+        flat = std::move(other.flat);
+        other.writeCursor = nullptr;
+        other.writeRemaining = 0;
+        other.lastInsertEnd = SIZE_MAX;
+        return *this;
+    }
+
+    size_t length() const override { return lengthOf(root); }
+
+    void insert(size_t offset, const std::string& text) {
+        if (text.empty()) return;
+        offset = std::min(offset, length());
+        auto parts = split(root, offset);
+        bool contiguous = offset == lastInsertEnd && writeCursor == lastWriteEnd
+            && writeRemaining >= text.size() && parts.first;
+        const char* data = write(text);
+        if (contiguous) {
+            parts.first = extendRightmost(parts.first, text.size());
+        }
+        else {
+            parts.first = merge(parts.first, leaf(Piece{ writeBlock, data, text.size() }));
+        }
+        root = merge(parts.first, parts.second);
+        lastInsertEnd = offset + text.size();
+        lastWriteEnd = writeCursor;
+        flat.reset();
+    }
+
+    void erase(size_t offset, size_t count) {
+        size_t len = length();
+        if (offset >= len || count == 0) return;
+        count = std::min(count, len - offset);
+        auto head = split(root, offset);
+        auto tail = split(head.second, count);
+        root = merge(head.first, tail.second);
+        lastInsertEnd = SIZE_MAX;
+        flat.reset();
+    }
+
+    // Calls fn(const char* data, size_t length) for each piece in text order
+    template <typename F>
+    void forEachChunk(F fn) const { forEachPiece(root, fn); }
+
+    // Same, limited to [offset, offset + count); O(log n) plus the pieces visited
+    template <typename F>
+    void forEachChunk(size_t offset, size_t count, F fn) const {
+        size_t len = length();
+        offset = std::min(offset, len);
+        forEachPieceIn(root, offset, offset + std::min(count, len - offset), fn);
+    }
+
+    void read(size_t offset, size_t count, const ChunkFn& fn) const override {
+        forEachChunk(offset, count, fn);
+    }
+
+    // Flattened copy, built on first use and cached until the next edit. The
+    // reference is only valid until this table is next edited, assigned or
+    // destroyed, and building it is not safe on several threads at once;
+    // rendering, counting and indexing read the pieces instead.
+    const std::string& str() const {
+        if (!flat) {
+            auto text = std::make_shared<std::string>();
+            text->reserve(length());
+            forEachChunk([&](const char* data, size_t n) { text->append(data, n); });
+            flat = std::move(text);
+        }
+        return *flat;
+    }
+
+    // Byte access for scans that walk the text mostly forwards. Stepping to a
+    // neighbouring piece is O(1), so a full scan is O(n) without a flat copy.
+    class Reader {
+    private:
+        std::vector<std::pair<const char*, size_t>> spans;
+        size_t index;
+        size_t start;  // Offset of spans[index]
+        size_t total;
+    public:
+        explicit Reader(const PieceTable& table) : index(0), start(0), total(table.length()) {
+            table.forEachChunk([&](const char* data, size_t n) { spans.emplace_back(data, n); });
+        }
+
+        size_t size() const { return total; }
+
+        char operator[](size_t offset) {
+            while (offset < start) start -= spans[--index].second;
+            while (offset >= start + spans[index].second) start += spans[index++].second;
+            return spans[index].first[offset - start];
+        }
+    };
+};
+
+// Word counting splits on the C-locale whitespace set (space and \t..\r),
+// the same way `istringstream >> word` does by default. A word starts at
+// every non-space byte preceded by a space, so the vector kernels classify a
+// block at once, turn it into a bit mask and popcount the word starts.
+// inWord carries across calls so text split into chunks counts correctly.
+inline bool isWordSpace(unsigned char c) {
+    return c == ' ' || static_cast<unsigned char>(c - '\t') < 5;
+}
+
+inline int popcount32(uint32_t bits) {
+#if defined(__GNUC__)
+    return __builtin_popcount(bits);
+#else
+    bits = bits - ((bits >> 1) & 0x55555555u);
+    bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+    return static_cast<int>((((bits + (bits >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
+}
+
+int countWordsScalar(const char* data, size_t length, bool& inWord) {
+    int count = 0;
+    for (size_t i = 0; i < length; ++i) {
+        bool space = isWordSpace(static_cast<unsigned char>(data[i]));
+        if (!space && !inWord) count++;
+        inWord = !space;
+    }
+    return count;
+}
+
+#if defined(DOCUMENT_EDITOR_SSE2)
+int countWordsSSE2(const char* data, size_t length, bool& inWord) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i controlLimit = _mm_set1_epi8(static_cast<char>(0x80 + 5));
+    int count = 0;
+    uint32_t carry = inWord ? 1 : 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // c - '\t' < 5 as an unsigned compare, done signed after flipping the top bit
+        __m128i control = _mm_cmplt_epi8(_mm_xor_si128(_mm_sub_epi8(bytes, tab), bias), controlLimit);
+        __m128i spaces = _mm_or_si128(_mm_cmpeq_epi8(bytes, space), control);
+        uint32_t words = ~static_cast<uint32_t>(_mm_movemask_epi8(spaces)) & 0xFFFFu;
+        count += popcount32(words & ~((words << 1) | carry));
+        carry = words >> 15;
+    }
+    inWord = carry != 0;
+    return count + countWordsScalar(data + i, length - i, inWord);
+}
+#endif
+
+#if defined(DOCUMENT_EDITOR_AVX2)
+__attribute__((target("avx2")))
+int countWordsAVX2(const char* data, size_t length, bool& inWord) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    int count = 0;
+    uint32_t carry = inWord ? 1 : 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        // c - '\t' <= 4 unsigned: the unsigned minimum with 4 is 4 itself
+        __m256i shifted = _mm256_sub_epi8(bytes, tab);
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, four), shifted);
+        __m256i spaces = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, space), control);
+        uint32_t words = ~static_cast<uint32_t>(_mm256_movemask_epi8(spaces));
+        count += popcount32(words & ~((words << 1) | carry));
+        carry = words >> 31;
+    }
+    inWord = carry != 0;
+    return count + countWordsSSE2(data + i, length - i, inWord);
+}
+#endif
+
+using WordCountKernel = int (*)(const char*, size_t, bool&);
+
+WordCountKernel selectWordCountKernel() {
+#if defined(DOCUMENT_EDITOR_AVX2)
+    if (__builtin_cpu_supports("avx2")) return countWordsAVX2;
+#endif
+#if defined(DOCUMENT_EDITOR_SSE2)
+    return countWordsSSE2;
+#else
+    return countWordsScalar;
+#endif
+}
+
+int countWords(const char* data, size_t length, bool& inWord) {
+    static const WordCountKernel kernel = selectWordCountKernel();
+    return kernel(data, length, inWord);
+}
+
+int countWords(const PieceTable& text) {
+    int count = 0;
+    bool inWord = false;
+    text.forEachChunk([&](const char* data, size_t n) { count += countWords(data, n, inWord); });
+    return count;
+}
+
+// [MEMENTO] - Immutable node of a persistent document tree. Nodes are shared
+// between snapshots and never modified, so a checkpoint copies only the
+// nodes on changed paths.
+struct SnapshotNode {
+    ElementKind kind;
+    uint64_t id;                          // Of the element the node was taken from
+    std::string label;                    // Section name or image path
+    PieceTable text;                      // Shares pieces with the live paragraph
+    FormatHandle format;
+    StyleRuns runs;
+    int rows, cols;
+    std::shared_ptr<const DocumentElement> prototype;  // Types without a snapshot encoding
+    std::vector<SnapshotPtr> children;
+    int elementCount;                     // Subtree totals, as measureElement() counts them
+    int wordCount;
+    bool childIdsRestorable;              // False when a copy's children still carry its source's IDs
+
+    SnapshotNode(ElementKind k, uint64_t elementId)
+        : kind(k), id(elementId), format(kNoFormat), rows(0), cols(0), elementCount(1), wordCount(0), childIdsRestorable(true) {
+    }
+};
+
+// Unknown element types are captured as a private clone
+SnapshotPtr DocumentElement::makeSnapshot() const {
+    auto node = std::make_shared<SnapshotNode>(ElementKind::Opaque, getId());
+    node->prototype = clone();
+    return node;
+}
+
+// Concrete Elements
+class Paragraph : public DocumentElement {
+protected:
+    PieceTable content;
+    FormatHandle format;
+    StyleRuns runs;               // Inline formatting, kept in step with edits
+    mutable int cachedWordCount;  // -1 until counted; reset by edits
+
+    // Merges touching runs that carry the same style
+    static void coalesce(StyleRuns& list) {
+        size_t out = 0;
+        for (size_t i = 0; i < list.size(); ++i) {
+            if (list[i].length == 0) continue;
+            if (out > 0 && list[out - 1].end() == list[i].offset && list[out - 1].sameStyle(list[i])) {
+                list[out - 1].length += list[i].length;
+            }
+            else {
+                list[out++] = list[i];
+            }
+        }
+        list.resize(out);
+    }
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::Paragraph; }
+
+    Paragraph(std::string text, FormatHandle fmt = kNoFormat)
+        : DocumentElement(ElementKind::Paragraph), content(text), format(fmt), cachedWordCount(-1) {
+    }
+
+    Paragraph(PieceTable text, FormatHandle fmt = kNoFormat, StyleRuns styleRuns = StyleRuns())
+        : DocumentElement(ElementKind::Paragraph), content(std::move(text)), format(fmt), runs(std::move(styleRuns)), cachedWordCount(-1) {
+    }
+
+    void draw(IRenderer* renderer) override {
+        if (runs.empty()) renderer->renderPieces(content);
+        else renderer->renderStyledPieces(content, runs);
+    }
+
+    std::unique_ptr<DocumentElement> clone() const override {
+        return std::make_unique<Paragraph>(*this);
+    }
+
+    void accept(class IDocumentVisitor* visitor) override;
+
+    std::string getType() const override { return "Paragraph"; }
+    // Flattened text, cached until the next edit; the reference is invalidated
+    // by any edit of this paragraph. Hot paths read getText() piece by piece.
+    const std::string& getContent() const { return content.str(); }
+    const PieceTable& getText() const { return content; }
+    FormatHandle getFormatHandle() const { return format; }
+    const CharacterFormat* getFormat() const { return CharacterFormatFactory::resolve(format); }
+    void setFormat(FormatHandle fmt) {
+        format = fmt;
+        touch();
+    }
+
+    const StyleRuns& getRuns() const { return runs; }
+    void setRuns(StyleRuns styleRuns) {
+        runs = std::move(styleRuns);
+        touch();
+    }
+
+    // Gives [offset, offset + length) the format and style bits, replacing
+    // any runs there; kNoFormat with no styles clears the range
+    void applyStyle(size_t offset, size_t length, FormatHandle fmt, uint8_t styles) {
+        size_t end = std::min(offset + length, content.length());
+        if (offset >= end) return;
+        StyleRuns updated;
+        updated.reserve(runs.size() + 2);
+        for (const StyleRun& run : runs) {
+            if (run.end() <= offset) updated.push_back(run);
+            else if (run.offset < offset) updated.push_back(StyleRun{ run.offset, uint32_t(offset - run.offset), run.format, run.styles });
+        }
+        if (fmt != kNoFormat || styles != 0) {
+            updated.push_back(StyleRun{ uint32_t(offset), uint32_t(end - offset), fmt, styles });
+        }
+        for (const StyleRun& run : runs) {
+            if (run.offset >= end) updated.push_back(run);
+            else if (run.end() > end) updated.push_back(StyleRun{ uint32_t(end), uint32_t(run.end() - end), run.format, run.styles });
+        }
+        coalesce(updated);
+        runs.swap(updated);
+        touch();
+    }
+    size_t length() const { return content.length(); }
+
+    int getWordCount() const {
+        if (cachedWordCount < 0) cachedWordCount = countWords(content);
+        return cachedWordCount;
+    }
+
+private:
+    // Word starts among the bytes in [from, to), given the byte before from.
+    // An edit can only change whether a word starts inside the edited range
+    // or right after it, so counting this window gives the word delta.
+    int wordStartsIn(size_t from, size_t to) const {
+        to = std::min(to, content.length());
+        if (from >= to) return 0;
+        bool inWord = false;
+        if (from > 0) {
+            content.forEachChunk(from - 1, 1, [&](const char* data, size_t) { inWord = !isWordSpace(static_cast<unsigned char>(*data)); });
+        }
+        int count = 0;
+        content.forEachChunk(from, to - from, [&](const char* data, size_t n) { count += countWords(data, n, inWord); });
+        return count;
+    }
+
+public:
+    // Edits at a character offset touch O(log n) pieces, never the whole text,
+    // and return the change in word count from the words around the edit
+    // Typing inside or at the end of a run extends it; later runs shift
+    int insertText(size_t offset, const std::string& text) {
+        offset = std::min(offset, content.length());
+        int before = wordStartsIn(offset, offset + 1);
+        content.insert(offset, text);
+        int delta = wordStartsIn(offset, offset + text.size() + 1) - before;
+        uint32_t added = static_cast<uint32_t>(text.size());
+        for (StyleRun& run : runs) {
+            if (run.offset < offset && run.end() >= offset) run.length += added;
+            else if (run.offset >= offset) run.offset += added;
+        }
+        if (cachedWordCount >= 0) cachedWordCount += delta;
+        touch();
+        return delta;
+    }
+    int eraseText(size_t offset, size_t count) {
+        size_t len = content.length();
+        if (offset >= len || count == 0) return 0;
+        count = std::min(count, len - offset);
+        int before = wordStartsIn(offset, offset + count + 1);
+        content.erase(offset, count);
+        int delta = wordStartsIn(offset, offset + 1) - before;
+        if (!runs.empty()) {
+            auto shift = [&](uint32_t pos) -> uint32_t {
+                if (pos <= offset) return pos;
+                return pos < offset + count ? uint32_t(offset) : uint32_t(pos - count);
+            };
+            for (StyleRun& run : runs) {
+                uint32_t start = shift(run.offset);
+                run.length = shift(run.end()) - start;
+                run.offset = start;
+            }
+            coalesce(runs);
+        }
+        if (cachedWordCount >= 0) cachedWordCount += delta;
+        touch();
+        return delta;
+    }
+
+protected:
+    SnapshotPtr makeSnapshot() const override {
+        auto node = std::make_shared<SnapshotNode>(ElementKind::Paragraph, getId());
+        node->text = content;
+        node->format = format;
+        node->runs = runs;
+        node->wordCount = getWordCount();
+        return node;
+    }
+};
+
+class Image : public DocumentElement {
+protected:
+    std::string imagePath;
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::Image; }
+
+    Image(std::string path) : DocumentElement(ElementKind::Image), imagePath(std::move(path)) {}
+
+    void draw(IRenderer* renderer) override {
+        renderer->renderImage(imagePath);
+    }
+
+    std::unique_ptr<DocumentElement> clone() const override {
+        return std::make_unique<Image>(*this);
+    }
+
+    void accept(class IDocumentVisitor* visitor) override;
+
+    std::string getType() const override { return "Image"; }
+    const std::string& getPath() const { return imagePath; }
+
+protected:
+    SnapshotPtr makeSnapshot() const override {
+        auto node = std::make_shared<SnapshotNode>(ElementKind::Image, getId());
+        node->label = imagePath;
+        return node;
+    }
+};
+
+class Table : public DocumentElement {
+protected:
+    int rows, cols;
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::Table; }
+
+    Table(int r, int c) : DocumentElement(ElementKind::Table), rows(r), cols(c) {}
+
+    void draw(IRenderer* renderer) override {
+        renderer->renderTable(rows, cols);
+    }
+
+    std::unique_ptr<DocumentElement> clone() const override {
+        return std::make_unique<Table>(*this);
+    }
+
+    void accept(class IDocumentVisitor* visitor) override;
+
+    std::string getType() const override { return "Table"; }
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+
+protected:
+    SnapshotPtr makeSnapshot() const override {
+        auto node = std::make_shared<SnapshotNode>(ElementKind::Table, getId());
+        node->rows = rows;
+        node->cols = cols;
+        return node;
+    }
+};
+
+// [COMPOSITE] - Section that contains elements
+std::unique_ptr<DocumentElement> materializeSnapshot(const SnapshotPtr& node, const ElementIndex* ids);
+
+class TextIndex;
+
+// ID -> element lookup for one document. Sections keep it current as
+// children come and go; elements inside a copy-on-write section that has
+// not been materialized yet are registered when they are built.
+class ElementIndex {
+private:
+    std::unordered_map<uint64_t, DocumentElement*> elements;
+    TextIndex* text;  // Optional full-text index fed with every added paragraph
+public:
+    ElementIndex() : text(nullptr) {}
+
+    void addSubtree(DocumentElement* element);
+    void removeSubtree(const DocumentElement* element);
+
+    DocumentElement* find(uint64_t id) const {
+        auto found = elements.find(id);
+        return found == elements.end() ? nullptr : found->second;
+    }
+
+    size_t size() const { return elements.size(); }
+    void clear();
+
+    TextIndex* getTextIndex() const { return text; }
+    void setTextIndex(TextIndex* index) { text = index; }
+};
+
+// [COMPOSITE] & [PROTOTYPE] - Copy-on-write section. A clone, or a section
+// restored from a memento, starts out holding only the immutable snapshot of
+// its contents, shared with the source. The first access to its children
+// builds them one level deep; child sections are built the same lazy way, so
+// an edit deep inside a copy only materializes the path leading to it.
+// Materializing mutates the section even through const access, so a shared
+// section must not be first touched from two threads at once; code that
+// hands subtrees to other threads calls materializeSubtree() first.
+class Section : public DocumentElement {
+protected:
+    mutable std::vector<std::unique_ptr<DocumentElement>> children;
+    mutable SnapshotPtr pendingChildren;  // Snapshot not yet materialized into children
+    std::string sectionName;
+    ElementIndex* index;  // Set on a document's root section only
+    bool restoresIds;     // Pending children take back their recorded IDs
+
+    void materialize() const {
+        if (pendingChildren) materializeChildren();
+    }
+    void materializeChildren() const;
+    void materializeSubtree() const;
+
+    // The index of the document this section belongs to: O(depth)
+    ElementIndex* owningIndex() const {
+        const DocumentElement* top = this;
+        while (top->getParent()) top = top->getParent();
+        return top->getKind() == ElementKind::Section ? static_cast<const Section*>(top)->index : nullptr;
+    }
+
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::Section; }
+
+    Section(std::string name = "")
+        : DocumentElement(ElementKind::Section), sectionName(std::move(name)), index(nullptr), restoresIds(false) {
+    }
+
+    // Lazy section over a snapshot; see materializeSnapshot()
+    Section(const SnapshotPtr& node, bool keepIds)
+        : DocumentElement(ElementKind::Section), pendingChildren(node->children.empty() ? nullptr : node),
+        sectionName(node->label), index(nullptr), restoresIds(keepIds) {
+    }
+
+    void add(std::unique_ptr<DocumentElement> el) {
+        materialize();
+        el->parent = this;
+        if (ElementIndex* ids = owningIndex()) ids->addSubtree(el.get());
+        children.push_back(std::move(el));
+        touch();
+    }
+
+    void insert(size_t position, std::unique_ptr<DocumentElement> el) {
+        materialize();
+        position = std::min(position, children.size());
+        el->parent = this;
+        if (ElementIndex* ids = owningIndex()) ids->addSubtree(el.get());
+        children.insert(children.begin() + position, std::move(el));
+        touch();
+    }
+
+    // Detaches and returns the child; nullptr if the index is out of range
+    std::unique_ptr<DocumentElement> remove(size_t position) {
+        materialize();
+        if (position >= children.size()) return nullptr;
+        auto el = std::move(children[position]);
+        children.erase(children.begin() + position);
+        if (ElementIndex* ids = owningIndex()) ids->removeSubtree(el.get());
+        el->parent = nullptr;
+        touch();
+        return el;
+    }
+
+    // Makes this the root of a document whose elements are looked up by ID
+    void attachIndex(ElementIndex* ids) {
+        index = ids;
+        if (index) index->addSubtree(this);
+    }
+
+    // Position of a direct child, or getChildren().size() if absent
+    size_t indexOf(const DocumentElement* el) const {
+        materialize();
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (children[i].get() == el) return i;
+        }
+        return children.size();
+    }
+
+    void draw(IRenderer* renderer) override {
+        materialize();
+        renderer->startSection();
+        for (auto& child : children) child->draw(renderer);
+        renderer->endSection();
+    }
+
+    // Renders child sections (and runs of consecutive non-section children)
+    // as separate tasks into private buffers, then stitches them in order.
+    // Each subtree is drawn by exactly one task, after this thread has built
+    // every lazy section in it.
+    void drawParallel(IRenderer* renderer, ThreadPool& pool);
+
+    // O(1) when nothing changed since the last snapshot, otherwise O(edited
+    // path); the copy shares everything else with this section
+    std::unique_ptr<DocumentElement> clone() const override {
+        return materializeSnapshot(snapshot(), nullptr);
+    }
+
+    void accept(class IDocumentVisitor* visitor) override;
+
+    std::string getType() const override { return "Section"; }
+    const std::string& getName() const { return sectionName; }
+    void setName(std::string name) {
+        sectionName = std::move(name);
+        touch();
+    }
+
+    // Replaces the name and contents with a snapshot's, keeping this object.
+    // On a document's root the whole tree is built and indexed at once, so
+    // every restored ID can be looked up; elsewhere it is built lazily.
+    void restore(const SnapshotPtr& node);
+
+    // Contents still shared with the section this one was copied from, or
+    // nullptr once the children have been built
+    const SnapshotNode* getPendingSnapshot() const { return pendingChildren.get(); }
+
+protected:
+    // Path copying: clean children contribute their cached nodes unchanged
+    SnapshotPtr makeSnapshot() const override {
+        if (pendingChildren && pendingChildren->id == getId() && (restoresIds || !pendingChildren->childIdsRestorable)) {
+            return pendingChildren;
+        }
+        if (pendingChildren) {
+            // Still the source's children: a restore must not hand their IDs to this copy
+            auto node = std::make_shared<SnapshotNode>(*pendingChildren);
+            node->id = getId();
+            node->childIdsRestorable = node->childIdsRestorable && restoresIds;
+            return node;
+        }
+        auto node = std::make_shared<SnapshotNode>(ElementKind::Section, getId());
+        node->label = sectionName;
+        node->children.reserve(children.size());
+        for (auto& child : children) {
+            node->children.push_back(child->snapshot());
+            node->elementCount += node->children.back()->elementCount;
+            node->wordCount += node->children.back()->wordCount;
+        }
+        return node;
+    }
+
+public:
+
+    const std::vector<std::unique_ptr<DocumentElement>>& getChildren() const {
+        materialize();
+        return children;
+    }
+};
+
+void Section::drawParallel(IRenderer* renderer, ThreadPool& pool) {
+    static constexpr size_t kMaxRun = 256;
+    materializeSubtree();
+    OutputSink* out = renderer->getSink();
+    if (!out || children.size() < 2) {
+        draw(renderer);
+        return;
+    }
+
+    struct Task {
+        std::unique_ptr<MemorySink> buffer;
+        std::future<void> done;
+    };
+    std::vector<Task> tasks;
+    size_t i = 0;
+    while (i < children.size()) {
+        size_t begin = i++;
+        if (children[begin]->getKind() != ElementKind::Section) {
+            while (i < children.size() && i - begin < kMaxRun && children[i]->getKind() != ElementKind::Section) i++;
+        }
+        Task task{ std::make_unique<MemorySink>(), std::future<void>() };
+        MemorySink* buffer = task.buffer.get();
+        size_t end = i;
+        task.done = pool.submit([this, renderer, buffer, begin, end] {
+            auto local = renderer->createForSink(*buffer);
+            for (size_t k = begin; k < end; ++k) children[k]->draw(local.get());
+            local->flush();
+        });
+        tasks.push_back(std::move(task));
+    }
+
+    // Tasks read the children and write their buffers, so every one must
+    // finish before anything is released, even after another has thrown
+    std::exception_ptr failure;
+    renderer->startSection();
+    for (auto& task : tasks) {
+        try {
+            task.done.get();
+            if (!failure) out->append(task.buffer->str());
+        }
+        catch (...) {
+            if (!failure) failure = std::current_exception();
+        }
+        task.buffer.reset();
+    }
+    if (failure) std::rethrow_exception(failure);
+    renderer->endSection();
+}
+
+// [FACTORY METHOD] - Element Factory
+class ElementFactory {
+public:
+    static std::unique_ptr<DocumentElement> createParagraph(const std::string& text) {
+        return std::make_unique<Paragraph>(text);
+    }
+
+    static std::unique_ptr<DocumentElement> createImage(const std::string& path) {
+        return std::make_unique<Image>(path);
+    }
+
+    static std::unique_ptr<DocumentElement> createTable(int rows, int cols) {
+        return std::make_unique<Table>(rows, cols);
+    }
+
+    static std::unique_ptr<DocumentElement> createSection(const std::string& name = "") {
+        return std::make_unique<Section>(name);
+    }
+};
+
+// [DECORATOR] - Text Formatting Decorators
+class TextDecorator : public DocumentElement {
+protected:
+    std::unique_ptr<DocumentElement> wrappedElement;
+public:
+    TextDecorator(ElementKind kind, std::unique_ptr<DocumentElement> element)
+        : DocumentElement(kind), wrappedElement(std::move(element)) {
+        wrappedElement->parent = this;
+    }
+
+    static bool classof(ElementKind kind) { return kind == ElementKind::Bold || kind == ElementKind::Italic; }
+
+    std::string getType() const override { return wrappedElement->getType(); }
+    DocumentElement* getWrapped() const { return wrappedElement.get(); }
+};
+
+class BoldDecorator : public TextDecorator {
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::Bold; }
+
+    BoldDecorator(std::unique_ptr<DocumentElement> element)
+        : TextDecorator(ElementKind::Bold, std::move(element)) {
+    }
+
+    void draw(IRenderer* renderer) override {
+        // Simplified: just render with bold flag
+        if (auto* para = elementCast<Paragraph>(wrappedElement.get())) {
+            renderer->renderPieces(para->getText(), true, false);
+        }
+        else {
+            wrappedElement->draw(renderer);
+        }
+    }
+
+    std::unique_ptr<DocumentElement> clone() const override {
+        return std::make_unique<BoldDecorator>(wrappedElement->clone());
+    }
+
+protected:
+    SnapshotPtr makeSnapshot() const override {
+        auto node = std::make_shared<SnapshotNode>(ElementKind::Bold, getId());
+        node->children.push_back(wrappedElement->snapshot());
+        node->wordCount = node->children.front()->wordCount;
+        return node;
+    }
+
+public:
+
+    void accept(class IDocumentVisitor* visitor) override {
+        wrappedElement->accept(visitor);
+    }
+};
+
+class ItalicDecorator : public TextDecorator {
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::Italic; }
+
     ItalicDecorator(std::unique_ptr<DocumentElement> element)
-        : TextDecorator(std::move(element)) {
+        : TextDecorator(ElementKind::Italic, std::move(element)) {
+    }
+
+    void draw(IRenderer* renderer) override {
+        if (auto* para = elementCast<Paragraph>(wrappedElement.get())) {
+            renderer->renderPieces(para->getText(), false, true);
+        }
+        else {
+            wrappedElement->draw(renderer);
+        }
+    }
+
+    std::unique_ptr<DocumentElement> clone() const override {
+        return std::make_unique<ItalicDecorator>(wrappedElement->clone());
+    }
+
+protected:
+    SnapshotPtr makeSnapshot() const override {
+        auto node = std::make_shared<SnapshotNode>(ElementKind::Italic, getId());
+        node->children.push_back(wrappedElement->snapshot());
+        node->wordCount = node->children.front()->wordCount;
+        return node;
+    }
+
+public:
+
+    void accept(class IDocumentVisitor* visitor) override {
+        wrappedElement->accept(visitor);
+    }
+};
+
+// [PROXY] - Loaded image bytes, shared by every proxy showing the image
+struct ImageData {
+    std::string path;
+    std::vector<char> bytes;  // Empty if the file could not be read
+};
+using ImagePtr = std::shared_ptr<const ImageData>;
+
+// [SINGLETON] - Process-wide LRU cache of loaded images with a byte budget.
+// Evicted images stay alive while someone still holds them, but are
+// reloaded on the next request.
+class ImageCache {
+private:
+    struct Entry {
+        ImagePtr image;
+        size_t bytes;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t budget;
+    size_t used;
+
+    ImageCache() : budget(kDefaultBudget), used(0) {}
+
+    static size_t costOf(const ImageData& image) { return sizeof(ImageData) + image.path.size() + image.bytes.size(); }
+
+    void evict() {
+        while (used > budget && !entries.empty()) {
+            used -= entries.back().bytes;
+            index.erase(entries.back().image->path);
+            entries.pop_back();
+        }
+    }
+
+public:
+    static constexpr size_t kDefaultBudget = 256 * 1024 * 1024;
+
+    static ImageCache& getInstance() {
+        static ImageCache instance;
+        return instance;
+    }
+
+    ImagePtr get(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(path);
+        if (found == index.end()) return nullptr;
+        entries.splice(entries.begin(), entries, found->second);
+        return found->second->image;
+    }
+
+    void put(const ImagePtr& image) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(image->path);
+        if (found != index.end()) {
+            used -= found->second->bytes;
+            entries.erase(found->second);
+        }
+        entries.push_front(Entry{ image, costOf(*image) });
+        index[image->path] = entries.begin();
+        used += entries.front().bytes;
+        evict();
+    }
+
+    bool contains(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return index.count(path) != 0;
+    }
+
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+        used = 0;
+    }
+
+    size_t getBudget() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return budget;
+    }
+    size_t bytesUsed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+};
+
+// [SINGLETON] - Background image loading. Requests for an image already in
+// flight share its result, and finished loads land in the ImageCache. The
+// cache check, the in-flight lookup and the hand-off to the cache all happen
+// under one lock, so each image is read at most once while it stays cached.
+// A failed read yields an empty image that is not cached, so the next
+// request tries the file again.
+class ImageLoaderPool {
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_future<ImagePtr>> pending;
+    ThreadPool workers;  // Declared last so workers are joined before the rest is torn down
+
+    // Touching the cache first makes it outlive the pool at exit
+    ImageLoaderPool() : workers((ImageCache::getInstance(), kThreads)) {}
+
+    // Runs on worker threads, so it reports failure instead of logging
+    static ImagePtr readImage(const std::string& path, bool& ok) {
+        auto image = std::make_shared<ImageData>();
+        image->path = path;
+        ok = false;
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (file.is_open()) {
+            std::streamoff size = file.tellg();
+            ok = size >= 0;
+            if (size > 0) {
+                image->bytes.resize(static_cast<size_t>(size));
+                file.seekg(0);
+                file.read(image->bytes.data(), size);
+                if (!file) {
+                    image->bytes.clear();
+                    ok = false;
+                }
+            }
+        }
+        return image;
+    }
+
+public:
+    static constexpr size_t kThreads = 2;
+
+    static ImageLoaderPool& getInstance() {
+        static ImageLoaderPool instance;
+        return instance;
+    }
+
+    // Starts loading unless the image is cached or already on its way
+    std::shared_future<ImagePtr> request(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ImagePtr cached = ImageCache::getInstance().get(path)) {
+            std::promise<ImagePtr> ready;
+            ready.set_value(cached);
+            return ready.get_future().share();
+        }
+        auto found = pending.find(path);
+        if (found != pending.end()) return found->second;
+        std::shared_future<ImagePtr> result = workers.submit([this, path] {
+            bool ok = false;
+            ImagePtr image = readImage(path, ok);
+            std::lock_guard<std::mutex> done(mutex);
+            if (ok) ImageCache::getInstance().put(image);
+            pending.erase(path);
+            return image;
+        }).share();
+        pending.emplace(path, result);
+        return result;
+    }
+
+    // Blocks until the image is available
+    ImagePtr load(const std::string& path) {
+        if (ImagePtr cached = ImageCache::getInstance().get(path)) return cached;
+        return request(path).get();
+    }
+};
+
+// [PROXY] - Virtual Proxy for Image Loading. Image data lives in the shared
+// ImageCache rather than in the proxy, so it is released under memory
+// pressure and shared between proxies of the same file.
+class ImageProxy : public DocumentElement {
+private:
+    std::string imagePath;
+public:
+    static bool classof(ElementKind kind) { return kind == ElementKind::ImageProxy; }
+
+    ImageProxy(std::string path) : DocumentElement(ElementKind::ImageProxy), imagePath(std::move(path)) {}
+
+    void draw(IRenderer* renderer) override {
+        ImageLoaderPool::getInstance().load(imagePath);
+        renderer->renderImage(imagePath);
+    }
+
+    std::unique_ptr<DocumentElement> clone() const override {
+        return std::make_unique<ImageProxy>(imagePath);
+    }
+
+    // Queues a background load so a later draw() does not wait
+    void prefetch() const { ImageLoaderPool::getInstance().request(imagePath); }
+    bool isLoaded() const { return ImageCache::getInstance().contains(imagePath); }
+    ImagePtr getImage() const { return ImageLoaderPool::getInstance().load(imagePath); }
+
+    void accept(class IDocumentVisitor* visitor) override;
+
+    std::string getType() const override { return "ImageProxy"; }
+    const std::string& getPath() const { return imagePath; }
+
+protected:
+    SnapshotPtr makeSnapshot() const override {
+        auto node = std::make_shared<SnapshotNode>(ElementKind::ImageProxy, getId());
+        node->label = imagePath;
+        return node;
+    }
+};
+
+// Tag-switch dispatch: calls fn with the element as its concrete built-in
+// class, or as a plain DocumentElement for Shape and Opaque kinds. Costs one
+// byte load and a jump instead of RTTI lookups.
+template <typename T, typename E>
+std::conditional_t<std::is_const<E>::value, const T, T>& asKind(E* element) {
+    return *static_cast<std::conditional_t<std::is_const<E>::value, const T, T>*>(element);
+}
+
+template <typename E, typename F>
+decltype(auto) dispatchElement(E* element, F&& fn) {
+    switch (element->getKind()) {
+    case ElementKind::Paragraph: return fn(asKind<Paragraph>(element));
+    case ElementKind::Image: return fn(asKind<Image>(element));
+    case ElementKind::Table: return fn(asKind<Table>(element));
+    case ElementKind::Section: return fn(asKind<Section>(element));
+    case ElementKind::ImageProxy: return fn(asKind<ImageProxy>(element));
+    case ElementKind::Bold: return fn(asKind<BoldDecorator>(element));
+    case ElementKind::Italic: return fn(asKind<ItalicDecorator>(element));
+    case ElementKind::Shape:
+    case ElementKind::Opaque: break;
+    }
+    return fn(*element);
+}
+
+// [MEMENTO] - Rebuilds live elements from a snapshot. Each new element is
+// seeded with the node it came from, so checkpointing again right after a
+// restore costs nothing. Sections come back copy-on-write; their children
+// follow on first access.
+// Given the document's index, an element takes back the ID its node records
+// unless a live element already holds it. Children of a copied section that
+// was never expanded still carry the source's IDs, so they always get new
+// ones; without an index every element gets a new ID. An element whose ID
+// differs from its node's is not seeded.
+std::unique_ptr<DocumentElement> materializeSnapshot(const SnapshotPtr& node, const ElementIndex* ids) {
+    std::unique_ptr<DocumentElement> element;
+    switch (node->kind) {
+    case ElementKind::Paragraph:
+        element = std::make_unique<Paragraph>(node->text, node->format, node->runs);
+        break;
+    case ElementKind::Image:
+        element = std::make_unique<Image>(node->label);
+        break;
+    case ElementKind::Table:
+        element = std::make_unique<Table>(node->rows, node->cols);
+        break;
+    case ElementKind::ImageProxy:
+        element = std::make_unique<ImageProxy>(node->label);
+        break;
+    case ElementKind::Section:
+        element = std::make_unique<Section>(node, ids && node->childIdsRestorable);  // Children follow on first access
+        break;
+    case ElementKind::Bold:
+        element = std::make_unique<BoldDecorator>(materializeSnapshot(node->children.front(), ids));
+        break;
+    case ElementKind::Italic:
+        element = std::make_unique<ItalicDecorator>(materializeSnapshot(node->children.front(), ids));
+        break;
+    case ElementKind::Shape:
+    case ElementKind::Opaque:
+        element = node->prototype->clone();
+        break;
+    }
+    if (ids && !ids->find(node->id)) element->id = node->id;
+    bool exact = element->id == node->id;
+    if (auto* decorator = elementCast<TextDecorator>(element.get())) {
+        exact = exact && decorator->getWrapped()->snapshotCache == node->children.front();
+    }
+    if (exact) {
+        element->snapshotCache = node;
+        element->snapshotVersion = element->version;
+    }
+    return element;
+}
+
+void Section::restore(const SnapshotPtr& node) {
+    ElementIndex* ids = owningIndex();
+    if (ids) {
+        for (auto& child : children) ids->removeSubtree(child.get());
+    }
+    children.clear();
+    sectionName = node->label;
+    pendingChildren = node->children.empty() ? nullptr : node;
+    restoresIds = node->childIdsRestorable;
+    touch();
+    if (node->id == getId()) {
+        snapshotCache = node;
+        snapshotVersion = version;
+    }
+    // Lookups by ID, and the text index, need every restored element live
+    if (ids) materializeSubtree();
+}
+
+// Builds one level; the section's own cached snapshot stays valid as long
+// as the new children reproduce it exactly, IDs included
+void Section::materializeChildren() const {
+    SnapshotPtr node = std::move(pendingChildren);
+    pendingChildren.reset();
+    ElementIndex* ids = owningIndex();
+    bool exact = true;
+    children.reserve(node->children.size());
+    for (auto& child : node->children) {
+        children.push_back(materializeSnapshot(child, restoresIds ? ids : nullptr));
+        children.back()->parent = const_cast<Section*>(this);
+        exact = exact && children.back()->snapshotCache == child;
+        if (ids) ids->addSubtree(children.back().get());
+    }
+    if (!exact) {
+        for (const DocumentElement* e = this; e && e->snapshotCache; e = e->getParent()) e->snapshotCache.reset();
+    }
+}
+
+// Builds every lazy section below this one, so the tree can be read from
+// several threads. Iterative, because documents can nest deeply.
+void Section::materializeSubtree() const {
+    std::vector<const DocumentElement*> pending{ this };
+    while (!pending.empty()) {
+        const DocumentElement* element = pending.back();
+        pending.pop_back();
+        if (auto* decorator = elementCast<TextDecorator>(element)) {
+            pending.push_back(decorator->getWrapped());
+        }
+        else if (auto* section = elementCast<Section>(element)) {
+            section->materialize();
+            for (auto& child : section->children) pending.push_back(child.get());
+        }
+    }
+}
+
+// ==========================================================
+// FULL-TEXT INDEX
+// ==========================================================
+
+// A hit for a term, phrase or prefix query: byte range inside the
+// paragraph's text
+struct TextMatch {
+    uint64_t elementId;
+    size_t offset;
+    size_t length;
+};
+
+// Inverted index from terms to the paragraphs containing them. Terms are
+// runs of letters and digits (bytes >= 0x80 count as letters, so UTF-8 words
+// stay whole), lowercased. Each paragraph keeps its tokens in text order,
+// each pointing at its term, and each term counts its occurrences per
+// paragraph; queries scan the token lists of the paragraphs a term names.
+// Terms are kept sorted so a prefix query is a range scan. A text edit
+// re-tokenizes only the words it touches; later tokens just shift.
+class TextIndex {
+private:
+    using Postings = std::unordered_map<uint64_t, uint32_t>;  // Element ID -> occurrences
+    using TermMap = std::map<std::string, Postings, std::less<>>;
+
+    struct Token {
+        uint32_t offset;          // Byte offset in the paragraph
+        TermMap::iterator term;   // Its key's length is the token's
+    };
+    using TokenList = std::vector<Token>;
+
+    TermMap terms;
+    std::unordered_map<uint64_t, TokenList> paragraphs;
+    TokenList scratch;  // Tokens of the window being re-indexed
+
+    static bool isTermByte(unsigned char c) { return std::isalnum(c) || c >= 0x80; }
+    static char foldCase(unsigned char c) { return static_cast<char>(c < 0x80 ? std::tolower(c) : c); }
+
+    // Calls fn(token, offset) for each term of a text that readChunks(sink)
+    // feeds to sink in pieces; token is reused between calls
+    template <typename Chunks, typename F>
+    static void forEachToken(Chunks&& readChunks, F&& fn) {
+        size_t offset = 0;
+        size_t start = 0;
+        bool inToken = false;
+        std::string token;
+        readChunks([&](const char* data, size_t n) {
+            for (size_t i = 0; i < n; ++i, ++offset) {
+                unsigned char c = static_cast<unsigned char>(data[i]);
+                if (isTermByte(c)) {
+                    if (!inToken) {
+                        inToken = true;
+                        start = offset;
+                        token.clear();
+                    }
+                    token += foldCase(c);
+                }
+                else if (inToken) {
+                    inToken = false;
+                    fn(token, start);
+                }
+            }
+        });
+        if (inToken) fn(token, start);
+    }
+
+    static std::vector<std::string> tokenize(const std::string& text) {
+        std::vector<std::string> tokens;
+        forEachToken([&](auto&& sink) { sink(text.data(), text.size()); },
+            [&](const std::string& token, size_t) { tokens.push_back(token); });
+        return tokens;
+    }
+
+    static size_t endOf(const Token& token) { return token.offset + token.term->first.size(); }
+
+    TermMap::iterator acquire(const std::string& token, uint64_t id) {
+        auto term = terms.find(token);
+        if (term == terms.end()) term = terms.emplace(token, Postings()).first;
+        term->second[id]++;
+        return term;
+    }
+
+    void release(TermMap::iterator term, uint64_t id) {
+        auto entry = term->second.find(id);
+        if (--entry->second > 0) return;
+        term->second.erase(entry);
+        if (term->second.empty()) terms.erase(term);
+    }
+
+    // Appends the tokens of [offset, offset + count) of the paragraph's text
+    void tokenizeRange(const Paragraph* para, size_t offset, size_t count, TokenList& out) {
+        uint64_t id = para->getId();
+        forEachToken([&](auto&& sink) { para->getText().forEachChunk(offset, count, sink); },
+            [&](const std::string& token, size_t start) {
+            out.push_back(Token{ static_cast<uint32_t>(offset + start), acquire(token, id) });
+        });
+    }
+
+    static void sortMatches(std::vector<TextMatch>& matches) {
+        std::sort(matches.begin(), matches.end(), [](const TextMatch& a, const TextMatch& b) {
+            return a.elementId != b.elementId ? a.elementId < b.elementId : a.offset < b.offset;
+        });
+    }
+
+    const TokenList& tokensOf(uint64_t id) const { return paragraphs.find(id)->second; }
+
+    void appendMatches(TermMap::const_iterator term, std::vector<TextMatch>& out) const {
+        for (auto& entry : term->second) {
+            uint32_t remaining = entry.second;
+            for (const Token& token : tokensOf(entry.first)) {
+                if (token.term != term) continue;
+                out.push_back(TextMatch{ entry.first, token.offset, term->first.size() });
+                if (--remaining == 0) break;
+            }
+        }
+    }
+
+public:
+    void addParagraph(const Paragraph* para) {
+        uint64_t id = para->getId();
+        TokenList tokens;
+        tokenizeRange(para, 0, para->getText().length(), tokens);
+        removeParagraph(id);  // After acquiring, so shared terms are not dropped and re-created
+        paragraphs[id] = std::move(tokens);
+    }
+
+    void removeParagraph(uint64_t id) {
+        auto found = paragraphs.find(id);
+        if (found == paragraphs.end()) return;
+        for (const Token& token : found->second) release(token.term, id);
+        paragraphs.erase(found);
+    }
+
+    void updateParagraph(const Paragraph* para) { addParagraph(para); }
+
+    // After `removed` bytes at offset were replaced by `inserted` new ones.
+    // Tokens overlapping or touching the edited range can merge, split or
+    // change, so they and the new text between them are tokenized again;
+    // the bytes just outside that window are separators by construction.
+    void updateRange(const Paragraph* para, size_t offset, size_t removed, size_t inserted) {
+        auto found = paragraphs.find(para->getId());
+        if (found == paragraphs.end()) {
+            addParagraph(para);
+            return;
+        }
+        TokenList& tokens = found->second;
+        size_t editEnd = offset + removed;
+        auto first = std::lower_bound(tokens.begin(), tokens.end(), offset,
+            [](const Token& token, size_t at) { return endOf(token) < at; });
+        auto last = std::upper_bound(first, tokens.end(), editEnd,
+            [](size_t at, const Token& token) { return at < token.offset; });
+        size_t windowStart = offset;
+        size_t windowEnd = editEnd;
+        if (first != last) {
+            windowStart = std::min<size_t>(windowStart, first->offset);
+            windowEnd = std::max(windowEnd, endOf(last[-1]));
+        }
+
+        scratch.clear();
+        tokenizeRange(para, windowStart, windowEnd - removed + inserted - windowStart, scratch);
+        for (auto token = first; token != last; ++token) release(token->term, para->getId());
+        for (auto token = last; token != tokens.end(); ++token) {
+            token->offset = static_cast<uint32_t>(token->offset + inserted - removed);
+        }
+        size_t at = static_cast<size_t>(first - tokens.begin());
+        size_t replaced = static_cast<size_t>(last - first);
+        if (scratch.size() > replaced) tokens.insert(last, scratch.size() - replaced, Token{});
+        else tokens.erase(first + scratch.size(), last);
+        std::copy(scratch.begin(), scratch.end(), tokens.begin() + at);
+    }
+
+    void clear() {
+        terms.clear();
+        paragraphs.clear();
+    }
+
+    // Every occurrence of one word, case-insensitively
+    std::vector<TextMatch> findTerm(const std::string& word) const {
+        std::vector<TextMatch> matches;
+        std::vector<std::string> tokens = tokenize(word);
+        if (tokens.size() != 1) return tokens.empty() ? matches : findPhrase(word);
+        auto term = terms.find(tokens.front());
+        if (term != terms.end()) appendMatches(term, matches);
+        sortMatches(matches);
+        return matches;
+    }
+
+    // Every word starting with the prefix
+    std::vector<TextMatch> findPrefix(const std::string& prefix) const {
+        std::vector<TextMatch> matches;
+        std::vector<std::string> tokens = tokenize(prefix);
+        if (tokens.size() != 1) return matches;
+        const std::string& key = tokens.front();
+        for (auto term = terms.lower_bound(key); term != terms.end() && term->first.compare(0, key.size(), key) == 0; ++term) {
+            appendMatches(term, matches);
+        }
+        sortMatches(matches);
+        return matches;
+    }
+
+    // Consecutive words, ignoring punctuation and spacing between them. The
+    // match spans from the first word's start to the last word's end.
+    std::vector<TextMatch> findPhrase(const std::string& phrase) const {
+        std::vector<TextMatch> matches;
+        std::vector<std::string> words = tokenize(phrase);
+        if (words.empty()) return matches;
+        std::vector<TermMap::const_iterator> wanted;
+        for (const std::string& word : words) {
+            auto term = terms.find(word);
+            if (term == terms.end()) return matches;
+            wanted.push_back(term);
+        }
+        // Only paragraphs holding the rarest word can match
+        size_t rarest = 0;
+        for (size_t i = 1; i < wanted.size(); ++i) {
+            if (wanted[i]->second.size() < wanted[rarest]->second.size()) rarest = i;
+        }
+        for (auto& entry : wanted[rarest]->second) {
+            bool candidate = true;
+            for (auto term : wanted) candidate = candidate && term->second.count(entry.first);
+            if (!candidate) continue;
+            const TokenList& tokens = tokensOf(entry.first);
+            for (size_t i = 0; i + wanted.size() <= tokens.size(); ++i) {
+                size_t k = 0;
+                while (k < wanted.size() && tokens[i + k].term == wanted[k]) k++;
+                if (k < wanted.size()) continue;
+                const Token& last = tokens[i + k - 1];
+                matches.push_back(TextMatch{ entry.first, tokens[i].offset, endOf(last) - tokens[i].offset });
+            }
+        }
+        sortMatches(matches);
+        return matches;
+    }
+
+    size_t termCount() const { return terms.size(); }
+    size_t paragraphCount() const { return paragraphs.size(); }
+};
+
+void ElementIndex::clear() {
+    elements.clear();
+    if (text) text->clear();
+}
+
+// Unbuilt parts of copy-on-write sections are skipped; they register
+// themselves as they materialize. The text index needs their words, so
+// while one is attached such sections are built right away.
+void ElementIndex::addSubtree(DocumentElement* element) {
+    elements[element->getId()] = element;
+    if (Section* section = elementCast<Section>(element)) {
+        if (section->getPendingSnapshot()) {
+            if (text) section->getChildren();
+            return;
+        }
+        for (auto& child : section->getChildren()) addSubtree(child.get());
+    }
+    else if (TextDecorator* decorator = elementCast<TextDecorator>(element)) {
+        addSubtree(decorator->getWrapped());
+    }
+    else if (text && element->getKind() == ElementKind::Paragraph) {
+        text->addParagraph(static_cast<const Paragraph*>(element));
+    }
+}
+
+void ElementIndex::removeSubtree(const DocumentElement* element) {
+    elements.erase(element->getId());
+    if (const Section* section = elementCast<Section>(element)) {
+        if (section->getPendingSnapshot()) return;
+        for (auto& child : section->getChildren()) removeSubtree(child.get());
+    }
+    else if (const TextDecorator* decorator = elementCast<TextDecorator>(element)) {
+        removeSubtree(decorator->getWrapped());
+    }
+    else if (text && element->getKind() == ElementKind::Paragraph) {
+        text->removeParagraph(element->getId());
+    }
+}
+
+// ==========================================================
+// DOCUMENT CLASS
+// ==========================================================
+
+// Element and word totals of a subtree
+struct ElementStats {
+    int elements;
+    int words;
+};
+
+// Paragraphs memoize their word count, so measuring only scans new or edited
+// text. A decorator counts as one element carrying the words it wraps.
+ElementStats measureElement(const DocumentElement* element);
+
+ElementStats measureChildren(const Section* section) {
+    ElementStats stats{ 0, 0 };
+    for (auto& child : section->getChildren()) {
+        ElementStats childStats = measureElement(child.get());
+        stats.elements += childStats.elements;
+        stats.words += childStats.words;
+    }
+    return stats;
+}
+
+ElementStats measureElement(const DocumentElement* element) {
+    switch (element->getKind()) {
+    case ElementKind::Paragraph:
+        return ElementStats{ 1, static_cast<const Paragraph*>(element)->getWordCount() };
+    case ElementKind::Section: {
+        // A copy-on-write section's totals come with its shared snapshot
+        if (const SnapshotNode* shared = static_cast<const Section*>(element)->getPendingSnapshot()) {
+            return ElementStats{ shared->elementCount, shared->wordCount };
+        }
+        ElementStats stats = measureChildren(static_cast<const Section*>(element));
+        stats.elements++;
+        return stats;
+    }
+    case ElementKind::Bold:
+    case ElementKind::Italic:
+        return ElementStats{ 1, measureElement(static_cast<const TextDecorator*>(element)->getWrapped()).words };
+    default:
+        return ElementStats{ 1, 0 };
+    }
+}
+
+// Queues background loads for every image proxy under the element
+size_t prefetchImages(const DocumentElement* element) {
+    switch (element->getKind()) {
+    case ElementKind::ImageProxy:
+        static_cast<const ImageProxy*>(element)->prefetch();
+        return 1;
+    case ElementKind::Section: {
+        size_t queued = 0;
+        for (auto& child : static_cast<const Section*>(element)->getChildren()) queued += prefetchImages(child.get());
+        return queued;
+    }
+    case ElementKind::Bold:
+    case ElementKind::Italic:
+        return prefetchImages(static_cast<const TextDecorator*>(element)->getWrapped());
+    default:
+        return 0;
+    }
+}
+
+// [OBSERVER] - Change delta handed to observers
+struct DocumentChange {
+    enum class Kind { Added, Removed, Modified };
+    Kind kind;
+    DocumentElement* element;
+    int elementDelta;
+    int wordDelta;
+};
+
+// [OBSERVER] - Observer Interface
+class IDocumentObserver {
+public:
+    virtual void onDocumentChanged(Document* doc) = 0;
+
+    // Incremental observers override this; by default it falls back to a full refresh
+    virtual void onChangesApplied(Document* doc, const std::vector<DocumentChange>& changes) {
+        onDocumentChanged(doc);
+    }
+
+    virtual ~IDocumentObserver() = default;
+};
+
+// Document Class (Observable)
+class Document {
+private:
+    ElementIndex elementIndex;  // Every element in the tree by ID
+    std::unique_ptr<TextIndex> textIndex;  // Optional, see enableTextIndex()
+    std::unique_ptr<Section> rootSection;
+    std::vector<IDocumentObserver*> observers;
+    std::unique_ptr<class DocumentState> currentState;
+    ElementArena* arena;
+    uint64_t restoreCount;  // Memento restores so far
+
+    // Flat copy of the tree, reused until the root's version stamp moves
+    mutable std::shared_ptr<const class FlatDocumentStore> flatCache;
+    mutable uint64_t flatVersion;
+
+    // Batched edits: changes queue up until the outermost batch commits
+    int batchDepth;
+    std::vector<DocumentChange> pendingChanges;
+    std::unordered_map<const DocumentElement*, size_t> pendingIndex;
+
+    // Document properties from Builder
+    std::string pageSize;
+    int marginTop, marginBottom, marginLeft, marginRight;
+    std::string header, footer;
+
+public:
+    Document();  // Implementation moved after DraftState is defined
+    ~Document() {
+        rootSection.reset();  // Elements go first so the arena can be freed in bulk
+        flatCache.reset();
+        if (arena) arena->release();
+    }
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    void setProperties(const std::string& ps, int mt, int mb, int ml, int mr,
+        const std::string& h, const std::string& f) {
+        pageSize = ps;
+        marginTop = mt; marginBottom = mb; marginLeft = ml; marginRight = mr;
+        header = h; footer = f;
+    }
+
+    const std::string& getPageSize() const { return pageSize; }
+    int getMarginTop() const { return marginTop; }
+    int getMarginBottom() const { return marginBottom; }
+    int getMarginLeft() const { return marginLeft; }
+    int getMarginRight() const { return marginRight; }
+    const std::string& getHeader() const { return header; }
+    const std::string& getFooter() const { return footer; }
+
+    void addElement(std::unique_ptr<DocumentElement> element) {
+        insertElement(rootSection.get(), rootSection->getChildren().size(), std::move(element));
+    }
+
+    // Structural edits that observers hear about. Each has an exact inverse:
+    // removeElement hands back the detached subtree for a later insertElement.
+    DocumentElement* insertElement(Section* parent, size_t index, std::unique_ptr<DocumentElement> element) {
+        DocumentElement* added = element.get();
+        parent->insert(index, std::move(element));
+        if (!observers.empty()) {
+            ElementStats stats = measureElement(added);
+            publish(DocumentChange{ DocumentChange::Kind::Added, added, stats.elements, stats.words });
+        }
+        return added;
+    }
+
+    std::unique_ptr<DocumentElement> removeElement(Section* parent, size_t index) {
+        auto removed = parent->remove(index);
+        if (removed && !observers.empty()) {
+            ElementStats stats = measureElement(removed.get());
+            publish(DocumentChange{ DocumentChange::Kind::Removed, removed.get(), -stats.elements, -stats.words });
+        }
+        return removed;
+    }
+
+    // toIndex is the element's final position in the target section
+    void moveElement(Section* from, size_t fromIndex, Section* to, size_t toIndex) {
+        Batch batch(this);
+        auto element = removeElement(from, fromIndex);
+        if (element) insertElement(to, toIndex, std::move(element));
+    }
+
+    // Returns the previous format
+    FormatHandle setFormat(Paragraph* para, FormatHandle format) {
+        FormatHandle previous = para->getFormatHandle();
+        para->setFormat(format);
+        if (!observers.empty()) publish(DocumentChange{ DocumentChange::Kind::Modified, para, 0, 0 });
+        return previous;
+    }
+
+    // Styles a character range inside a paragraph; returns the previous runs
+    StyleRuns applyStyle(Paragraph* para, size_t offset, size_t length, FormatHandle format, uint8_t styles) {
+        StyleRuns previous = para->getRuns();
+        para->applyStyle(offset, length, format, styles);
+        if (!observers.empty()) publish(DocumentChange{ DocumentChange::Kind::Modified, para, 0, 0 });
+        return previous;
+    }
+
+    void setRuns(Paragraph* para, StyleRuns runs) {
+        para->setRuns(std::move(runs));
+        if (!observers.empty()) publish(DocumentChange{ DocumentChange::Kind::Modified, para, 0, 0 });
+    }
+
+    // Text edits that observers hear about, with the word delta precomputed
+    void insertText(Paragraph* para, size_t offset, const std::string& text) {
+        offset = std::min(offset, para->getText().length());
+        int delta = para->insertText(offset, text);
+        reindexText(para, offset, 0, text.size());
+        notifyModified(para, delta);
+    }
+
+    void eraseText(Paragraph* para, size_t offset, size_t count) {
+        size_t length = para->getText().length();
+        count = offset < length ? std::min(count, length - offset) : 0;
+        int delta = para->eraseText(offset, count);
+        if (count > 0) reindexText(para, offset, count, 0);
+        notifyModified(para, delta);
+    }
+
+    void draw(IRenderer* renderer) {
+        rootSection->draw(renderer);
+        renderer->flush();
+    }
+
+    // Same output as draw(), with top-level sections rendered on the pool
+    void drawParallel(IRenderer* renderer, ThreadPool& pool) {
+        rootSection->drawParallel(renderer, pool);
+        renderer->flush();
+    }
+
+    // Starts loading every image in the background ahead of draw()
+    size_t prefetchImages() const { return ::prefetchImages(rootSection.get()); }
+
+    Section* getRootSection() { return rootSection.get(); }
+
+    // Flat copy of the whole tree for read-only passes such as save; built
+    // on first use and shared until the next edit anywhere in the document
+    std::shared_ptr<const FlatDocumentStore> flatStore() const;
+
+    // Constant-time lookups by DocumentElement::getId(); nullptr when the
+    // element is not in this document
+    DocumentElement* findElement(uint64_t id) const { return elementIndex.find(id); }
+
+    // The owning section or decorator; nullptr for the root or unknown IDs
+    DocumentElement* findParent(uint64_t id) const {
+        DocumentElement* element = elementIndex.find(id);
+        return element ? element->getParent() : nullptr;
+    }
+
+    template <typename T>
+    T* findElementAs(uint64_t id) const { return elementCast<T>(elementIndex.find(id)); }
+
+    size_t indexedElementCount() const { return elementIndex.size(); }
+
+    // Full-text search. Building the index reads every paragraph (and
+    // materializes copy-on-write sections); afterwards structural edits and
+    // Document::insertText/eraseText keep it current. Text changed directly
+    // on a Paragraph is not seen.
+    void enableTextIndex() {
+        if (textIndex) return;
+        textIndex = std::make_unique<TextIndex>();
+        elementIndex.setTextIndex(textIndex.get());
+        elementIndex.addSubtree(rootSection.get());
+    }
+
+    void disableTextIndex() {
+        elementIndex.setTextIndex(nullptr);
+        textIndex.reset();
+    }
+
+    // nullptr unless enabled
+    const TextIndex* getTextIndex() const { return textIndex.get(); }
+
+    // Arena mode: elements created (e.g. via ElementFactory or clone()) while
+    // an allocation scope is alive are laid out contiguously in the document's
+    // arena and released together with the document, and so are the blocks
+    // and nodes of their piece tables. FileManagerFacade::load and the XML
+    // import build into an arena. Section child vectors, names and paths too
+    // long for the string's inline buffer, style run vectors and the index
+    // maps stay on the heap.
+    void enableArena(size_t blockSize = ElementArena::kDefaultBlockSize) {
+        if (!arena) arena = new ElementArena(blockSize);
+    }
+
+    ElementArena::Scope allocationScope() { return ElementArena::Scope(arena); }
+    const ElementArena* getArena() const { return arena; }
+
+    // Observer pattern
+    void attach(IDocumentObserver* observer) {
+        observers.push_back(observer);
+    }
+
+    void detach(IDocumentObserver* observer) {
+        observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+    }
+
+    void notifyObservers() {
+        for (auto* observer : observers) {
+            observer->onDocumentChanged(this);
+        }
+    }
+
+    void notifyObservers(const std::vector<DocumentChange>& changes) {
+        for (auto* observer : observers) {
+            observer->onChangesApplied(this, changes);
+        }
+    }
+
+    // Transactions: while a batch is open, changes are held back and then
+    // delivered as one coalesced change set when the outermost batch commits.
+    // Element pointers in that set may refer to elements removed later in the
+    // same batch; observers should rely on the deltas.
+    void beginBatch() { batchDepth++; }
+
+    void commitBatch() {
+        if (batchDepth == 0 || --batchDepth > 0) return;
+        if (pendingChanges.empty()) return;
+        std::vector<DocumentChange> changes;
+        changes.swap(pendingChanges);
+        pendingIndex.clear();
+        notifyObservers(changes);
+    }
+
+    bool inBatch() const { return batchDepth > 0; }
+
+    // Scoped guard around beginBatch()/commitBatch()
+    class Batch {
+    private:
+        Document* document;
+    public:
+        explicit Batch(Document* doc) : document(doc) { document->beginBatch(); }
+        ~Batch() { document->commitBatch(); }
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+    };
+
+private:
+    void publish(const DocumentChange& change) {
+        if (batchDepth == 0) {
+            notifyObservers({ change });
+            return;
+        }
+        // Repeated edits of one element fold into its earlier entry
+        if (change.kind == DocumentChange::Kind::Modified) {
+            auto found = pendingIndex.find(change.element);
+            if (found != pendingIndex.end()) {
+                pendingChanges[found->second].elementDelta += change.elementDelta;
+                pendingChanges[found->second].wordDelta += change.wordDelta;
+                return;
+            }
+        }
+        if (change.kind != DocumentChange::Kind::Removed) {
+            pendingIndex[change.element] = pendingChanges.size();
+        }
+        else {
+            pendingIndex.erase(change.element);
+        }
+        pendingChanges.push_back(change);
+    }
+
+    void reindexText(const Paragraph* para, size_t offset, size_t removed, size_t inserted) {
+        if (textIndex && elementIndex.find(para->getId()) == para) textIndex->updateRange(para, offset, removed, inserted);
+    }
+
+    void notifyModified(Paragraph* para, int wordDelta) {
+        if (observers.empty()) return;
+        publish(DocumentChange{ DocumentChange::Kind::Modified, para, 0, wordDelta });
+    }
+
+public:
+
+    // Memento pattern
+    class DocumentMemento createMemento() const;
+    void restoreMemento(const class DocumentMemento& memento);
+    uint64_t getRestoreCount() const { return restoreCount; }
+
+    // State pattern
+    void setState(std::unique_ptr<class DocumentState> state);
+    void edit();
+    class DocumentState* getState() { return currentState.get(); }
+};
+
+// Builder build method implementation
+std::unique_ptr<Document> DocumentBuilder::build() {
+    auto doc = std::make_unique<Document>();
+    doc->setProperties(pageSize, marginTop, marginBottom, marginLeft, marginRight, header, footer);
+    return doc;
+}
+
+// ==========================================================
+// LAYOUT AND PAGINATION
+// ==========================================================
+
+// Page geometry in points (1/72 inch). Paper comes from the document's page
+// size (or ApplicationSettings when the document names none), margins are
+// the builder's millimetres, and text without a format uses the
+// application's default font.
+struct PageSetup {
+    float width, height;
+    float marginTop, marginBottom, marginLeft, marginRight;
+    float headerHeight, footerHeight;
+    std::string fontName;
+    int fontSize;
+
+    static bool paperSize(const std::string& name, float& width, float& height) {
+        std::string key;
+        for (char c : name) key += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        if (key == "A3") { width = 842; height = 1191; }
+        else if (key == "A4") { width = 595; height = 842; }
+        else if (key == "A5") { width = 420; height = 595; }
+        else if (key == "LETTER") { width = 612; height = 792; }
+        else if (key == "LEGAL") { width = 612; height = 1008; }
+        else return false;
+        return true;
+    }
+
+    static PageSetup fromDocument(const Document& doc) {
+        static constexpr float kPointsPerMm = 72.0f / 25.4f;
+        ApplicationSettings* settings = ApplicationSettings::getInstance();
+        PageSetup setup;
+        if (!paperSize(doc.getPageSize(), setup.width, setup.height) && !paperSize(settings->paperSize, setup.width, setup.height)) {
+            paperSize("A4", setup.width, setup.height);
+        }
+        setup.marginTop = doc.getMarginTop() * kPointsPerMm;
+        setup.marginBottom = doc.getMarginBottom() * kPointsPerMm;
+        setup.marginLeft = doc.getMarginLeft() * kPointsPerMm;
+        setup.marginRight = doc.getMarginRight() * kPointsPerMm;
+        setup.fontName = settings->fontName;
+        setup.fontSize = settings->defaultFontSize;
+        float lineHeight = setup.fontSize * 1.2f;
+        setup.headerHeight = doc.getHeader().empty() ? 0 : lineHeight;
+        setup.footerHeight = doc.getFooter().empty() ? 0 : lineHeight;
+        return setup;
+    }
+
+    float contentWidth() const { return std::max(1.0f, width - marginLeft - marginRight); }
+    float contentHeight() const { return std::max(1.0f, height - marginTop - marginBottom - headerHeight - footerHeight); }
+
+    bool operator==(const PageSetup& other) const {
+        return width == other.width && height == other.height && marginTop == other.marginTop
+            && marginBottom == other.marginBottom && marginLeft == other.marginLeft && marginRight == other.marginRight
+            && headerHeight == other.headerHeight && footerHeight == other.footerHeight
+            && fontName == other.fontName && fontSize == other.fontSize;
+    }
+};
+
+// Approximate metrics: an average advance per character from the font
+// family and size, and a line height of 1.2 em
+struct FontMetrics {
+    float charWidth;
+    float lineHeight;
+
+    static FontMetrics of(const std::string& fontName, int fontSize, bool bold) {
+        float factor = 0.5f;
+        if (fontName == "Courier" || fontName == "Courier New") factor = 0.6f;
+        else if (fontName == "Times" || fontName == "Times New Roman" || fontName == "Georgia") factor = 0.45f;
+        if (bold) factor *= 1.1f;
+        return FontMetrics{ fontSize * factor, fontSize * 1.2f };
     }
 
-    void draw(IRenderer* renderer) override {
-        if (auto* para = dynamic_cast<Paragraph*>(wrappedElement.get())) {
-            renderer->renderText(para->getContent(), false, true);
+    static FontMetrics of(const CharacterFormat* format, const PageSetup& setup, bool bold) {
+        return format ? of(format->fontName, format->fontSize, bold) : of(setup.fontName, setup.fontSize, bold);
+    }
+};
+
+// One line (or, for images and tables, the whole element) as placed on a page
+struct LineBox {
+    uint32_t offset;  // Byte range of the paragraph text; 0/0 for blocks
+    uint32_t length;
+    float height;
+};
+
+// Cached layout of one element. version is the element's version stamp
+// when it was laid out, so a mismatch marks the entry dirty.
+struct ElementLayout {
+    uint64_t version;
+    std::vector<LineBox> lines;
+    float spaceAfter;
+};
+
+// First line on each page
+struct PageLayout {
+    size_t firstBlock;
+    uint32_t firstLine;
+};
+
+// Layout engine: breaks paragraphs into lines and flows the
+// lines onto pages. Elements are laid out once and cached by ID against
+// their version stamp, so after an edit only changed elements are
+// measured again. Pagination remembers where every element started and
+// resumes from the first changed element; once the flow after the edit
+// lines up with the previous one again, the remaining pages are reused.
+// Finding the changes descends only into sections whose version stamp
+// moved, since a section that did not change still owns the same run of
+// blocks. Edits that keep the sequence of elements are patched in place;
+// others rebuild the block list, copying the runs of clean sections.
+class LayoutEngine {
+public:
+    struct UpdateStats {
+        size_t elementsLaidOut;   // Elements whose lines were recomputed
+        size_t firstChangedPage;  // Pages before this one were kept as they were
+        size_t pagesPaginated;    // Pages flowed again
+    };
+
+private:
+    struct Block {
+        const DocumentElement* element;
+        uint64_t id;
+        uint64_t version;
+        ElementLayout* layout;
+
+        bool sameAs(const Block& other) const { return id == other.id && version == other.version; }
+    };
+    // The run of blocks a section contributed when it was last collected
+    struct SectionSpan {
+        uint64_t version;
+        size_t first;
+        size_t count;
+        uint64_t firstId;  // Tells whether first still points at the run
+    };
+    struct SectionRun {
+        const Section* section;
+        size_t first;
+        size_t count;
+    };
+    struct FlowState {
+        uint32_t page;
+        float y;
+        bool operator==(const FlowState& other) const { return page == other.page && y == other.y; }
+    };
+
+    Document* document;
+    PageSetup setup;
+    bool laidOut;
+    std::unordered_map<uint64_t, ElementLayout> cache;
+    std::vector<Block> blocks;
+    std::vector<FlowState> starts;  // Flow state before each block's first line
+    std::vector<PageLayout> pages;
+    FlowState end;                  // Flow state after the last block
+    UpdateStats lastUpdate;
+    std::unordered_map<uint64_t, SectionSpan> spans;  // Section ID -> its blocks
+    size_t liveSpans;               // Spans left after the last pruning
+    // Noted by scan(), applied by patch()
+    std::vector<std::pair<size_t, const DocumentElement*>> changedBlocks;
+    std::vector<SectionRun> changedSections;
+
+    // Greedy word wrap; runs may change the font mid-line, and a word wider
+    // than the line is broken between characters
+    void layoutParagraph(const Paragraph* para, bool bold, ElementLayout& out) const {
+        PieceTable::Reader text(para->getText());
+        const StyleRuns& runs = para->getRuns();
+        FontMetrics base = FontMetrics::of(para->getFormat(), setup, bold);
+        float limit = setup.contentWidth();
+        out.lines.clear();
+        out.spaceAfter = base.lineHeight * 0.5f;
+
+        size_t run = 0;
+        auto metricsAt = [&](size_t offset) {
+            while (run < runs.size() && runs[run].end() <= offset) run++;
+            if (run < runs.size() && runs[run].offset <= offset) {
+                const StyleRun& r = runs[run];
+                const CharacterFormat* format = r.format != kNoFormat ? CharacterFormatFactory::resolve(r.format) : para->getFormat();
+                return FontMetrics::of(format, setup, bold || (r.styles & StyleRun::Bold));
+            }
+            return base;
+        };
+
+        LineBox line{ 0, 0, base.lineHeight };
+        float width = 0;
+        size_t i = 0;
+        while (i < text.size()) {
+            size_t wordStart = i;
+            float wordWidth = 0;
+            float wordHeight = 0;
+            while (i < text.size() && !isWordSpace(static_cast<unsigned char>(text[i]))) {
+                FontMetrics m = metricsAt(i);
+                if (width + wordWidth + m.charWidth > limit && width == 0 && i > wordStart) {
+                    // The word alone overflows the line: break it here
+                    out.lines.push_back(LineBox{ line.offset, static_cast<uint32_t>(i - line.offset), std::max(line.height, wordHeight) });
+                    line = LineBox{ static_cast<uint32_t>(i), 0, base.lineHeight };
+                    wordStart = i;
+                    wordWidth = 0;
+                    wordHeight = 0;
+                }
+                wordWidth += m.charWidth;
+                wordHeight = std::max(wordHeight, m.lineHeight);
+                i++;
+            }
+            if (width > 0 && width + wordWidth > limit) {
+                out.lines.push_back(LineBox{ line.offset, static_cast<uint32_t>(wordStart - line.offset), line.height });
+                line = LineBox{ static_cast<uint32_t>(wordStart), 0, base.lineHeight };
+                width = 0;
+            }
+            width += wordWidth;
+            line.height = std::max(line.height, wordHeight);
+            // Trailing spaces hang past the margin instead of wrapping
+            while (i < text.size() && isWordSpace(static_cast<unsigned char>(text[i]))) {
+                if (text[i] == '\n') break;
+                width += metricsAt(i).charWidth;
+                i++;
+            }
+            if (i < text.size() && text[i] == '\n') {
+                out.lines.push_back(LineBox{ line.offset, static_cast<uint32_t>(i - line.offset), line.height });
+                line = LineBox{ static_cast<uint32_t>(i + 1), 0, base.lineHeight };
+                width = 0;
+                i++;
+            }
         }
-        else {
-            wrappedElement->draw(renderer);
+        line.length = static_cast<uint32_t>(text.size() - line.offset);
+        out.lines.push_back(line);
+    }
+
+    void layoutElement(const DocumentElement* element, ElementLayout& out) const {
+        FontMetrics base = FontMetrics::of(nullptr, setup, false);
+        bool bold = false;
+        while (const TextDecorator* decorator = elementCast<TextDecorator>(element)) {
+            bold = bold || element->getKind() == ElementKind::Bold;
+            element = decorator->getWrapped();
         }
+        switch (element->getKind()) {
+        case ElementKind::Paragraph:
+            layoutParagraph(static_cast<const Paragraph*>(element), bold, out);
+            return;
+        case ElementKind::Image:
+        case ElementKind::ImageProxy:
+            out.lines.assign(1, LineBox{ 0, 0, std::min(150.0f, setup.contentHeight()) });
+            break;
+        case ElementKind::Table: {
+            // Rows may split across pages like lines
+            const Table* table = static_cast<const Table*>(element);
+            out.lines.assign(static_cast<size_t>(std::max(table->getRows(), 1)), LineBox{ 0, 0, base.lineHeight + 4 });
+            break;
+        }
+        default:
+            out.lines.assign(1, LineBox{ 0, 0, base.lineHeight });
+            break;
+        }
+        out.spaceAfter = base.lineHeight * 0.5f;
     }
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        return std::make_unique<ItalicDecorator>(wrappedElement->clone());
+    void layoutBlock(Block& block, const DocumentElement* element, size_t& laidOutCount) {
+        ElementLayout& entry = *block.layout;
+        if (entry.lines.empty() || entry.version != element->getVersion()) {
+            layoutElement(element, entry);
+            entry.version = element->getVersion();
+            laidOutCount++;
+        }
+        block.element = element;
+        block.version = element->getVersion();
     }
 
-    void accept(class IDocumentVisitor* visitor) override {
-        wrappedElement->accept(visitor);
+    void recordSpan(const Section* section, size_t first, size_t count) {
+        spans[section->getId()] = SectionSpan{ section->getVersion(), first, count, count ? blocks[first].id : 0 };
     }
-};
 
-// [PROXY] - Virtual Proxy for Image Loading
-class ImageProxy : public DocumentElement {
-private:
-    std::string imagePath;
-    mutable std::unique_ptr<Image> realImage;
+    // The section's run in old if the section has not changed since it was
+    // collected and the run is still where it was, otherwise nullptr
+    const SectionSpan* cleanSpan(const Section* section, const std::vector<Block>& old) const {
+        auto found = spans.find(section->getId());
+        if (found == spans.end() || found->second.version != section->getVersion()) return nullptr;
+        const SectionSpan& span = found->second;
+        if (span.count == 0) return &span;
+        if (span.first + span.count > old.size() || old[span.first].id != span.firstId) return nullptr;
+        return &span;
+    }
 
-    void loadImage() const {
-        if (!realImage) {
-            std::cout << "[Proxy] Loading image: " << imagePath << std::endl;
-            realImage = std::make_unique<Image>(imagePath);
+    // Checks that the section still yields the blocks from pos on, in the
+    // same order, noting changed leaves and sections for patch() to apply;
+    // clean sections are skipped whole
+    bool scan(const Section* section, size_t& pos) {
+        size_t first = pos;
+        for (auto& child : section->getChildren()) {
+            const DocumentElement* element = child.get();
+            if (const Section* inner = elementCast<Section>(element)) {
+                if (const SectionSpan* span = cleanSpan(inner, blocks)) {
+                    if (span->count && span->first != pos) return false;
+                    pos += span->count;
+                }
+                else if (!scan(inner, pos)) {
+                    return false;
+                }
+                continue;
+            }
+            if (pos >= blocks.size() || blocks[pos].id != element->getId()) return false;
+            if (blocks[pos].version != element->getVersion()) changedBlocks.emplace_back(pos, element);
+            pos++;
         }
+        changedSections.push_back(SectionRun{ section, first, pos - first });
+        return true;
     }
-public:
-    ImageProxy(std::string path) : imagePath(path), realImage(nullptr) {}
 
-    void draw(IRenderer* renderer) override {
-        loadImage();
-        realImage->draw(renderer);
+    // Re-lays out changed leaves in place when the document still has the
+    // same elements in the same order; leaves everything as it was and
+    // returns false otherwise
+    bool patch(const Section* root, size_t& laidOutCount) {
+        changedBlocks.clear();
+        changedSections.clear();
+        size_t pos = 0;
+        if (!scan(root, pos) || pos != blocks.size()) return false;
+        for (auto& changed : changedBlocks) layoutBlock(blocks[changed.first], changed.second, laidOutCount);
+        for (const SectionRun& run : changedSections) recordSpan(run.section, run.first, run.count);
+        return true;
     }
 
-    std::unique_ptr<DocumentElement> clone() const override {
-        return std::make_unique<ImageProxy>(imagePath);
+    // Leaves in document order; sections contribute their children, and
+    // clean sections their old run of blocks
+    void collect(const DocumentElement* element, const std::vector<Block>& old, size_t& laidOutCount) {
+        if (const Section* section = elementCast<Section>(element)) {
+            size_t first = blocks.size();
+            if (const SectionSpan* span = cleanSpan(section, old)) {
+                blocks.insert(blocks.end(), old.begin() + span->first, old.begin() + span->first + span->count);
+            }
+            else {
+                for (auto& child : section->getChildren()) collect(child.get(), old, laidOutCount);
+            }
+            recordSpan(section, first, blocks.size() - first);
+            return;
+        }
+        blocks.push_back(Block{ element, element->getId(), 0, &cache[element->getId()] });
+        layoutBlock(blocks.back(), element, laidOutCount);
     }
 
-    void accept(class IDocumentVisitor* visitor) override;
+    void setPage(size_t index, const PageLayout& page) {
+        if (index < pages.size()) pages[index] = page;
+        else pages.push_back(page);
+    }
 
-    std::string getType() const override { return "ImageProxy"; }
-};
+    // Flows blocks from `from` onwards onto pages, starting in state, and
+    // writes starts and pages in place. From `unchanged` on, blocks match
+    // the old layout's tail and starts still holds their old starts; if
+    // one of them starts exactly where it did before, the rest would flow
+    // the same, so this stops there, keeping the later starts and pages,
+    // and returns its index. Otherwise returns blocks.size().
+    size_t flow(size_t from, size_t unchanged, FlowState state) {
+        float limit = setup.contentHeight();
+        if (from == 0) setPage(0, PageLayout{ 0, 0 });
+        for (size_t i = from; i < blocks.size(); ++i) {
+            if (i >= unchanged && i > from && starts[i] == state) return i;
+            starts[i] = state;
+            const ElementLayout& layout = *blocks[i].layout;
+            for (size_t line = 0; line < layout.lines.size(); ++line) {
+                float height = layout.lines[line].height;
+                if (state.y > 0 && state.y + height > limit) {
+                    state.page++;
+                    state.y = 0;
+                    setPage(state.page, PageLayout{ i, static_cast<uint32_t>(line) });
+                }
+                state.y += height;
+            }
+            state.y += layout.spaceAfter;
+        }
+        end = state;
+        pages.resize(state.page + 1);
+        return blocks.size();
+    }
 
-// ==========================================================
-// DOCUMENT CLASS
-// ==========================================================
+    // Spans of sections that left the document
+    void pruneSpans(const Section* root) {
+        if (spans.size() <= 2 * liveSpans + 64) return;
+        std::unordered_map<uint64_t, SectionSpan> live;
+        std::vector<const Section*> pending{ root };
+        while (!pending.empty()) {
+            const Section* section = pending.back();
+            pending.pop_back();
+            auto found = spans.find(section->getId());
+            if (found != spans.end()) live.insert(*found);
+            for (auto& child : section->getChildren()) {
+                if (const Section* inner = elementCast<Section>(child.get())) pending.push_back(inner);
+            }
+        }
+        spans.swap(live);
+        liveSpans = spans.size();
+    }
 
-// [OBSERVER] - Observer Interface
-class IDocumentObserver {
 public:
-    virtual void onDocumentChanged(Document* doc) = 0;
-    virtual ~IDocumentObserver() = default;
-};
+    explicit LayoutEngine(Document* doc)
+        : document(doc), setup(PageSetup::fromDocument(*doc)), laidOut(false), end{ 0, 0 }, lastUpdate{ 0, 0, 0 }, liveSpans(0) {
+    }
 
-// Document Class (Observable)
-class Document {
-private:
-    std::unique_ptr<Section> rootSection;
-    std::vector<IDocumentObserver*> observers;
-    std::unique_ptr<class DocumentState> currentState;
+    // Brings the layout up to date with the document
+    const UpdateStats& update() {
+        PageSetup current = PageSetup::fromDocument(*document);
+        if (!(current == setup)) {
+            setup = current;
+            invalidate();
+        }
 
-    // Document properties from Builder
-    std::string pageSize;
-    int marginTop, marginBottom, marginLeft, marginRight;
-    std::string header, footer;
+        const Section* root = document->getRootSection();
+        auto rootSpan = spans.find(root->getId());
+        if (laidOut && rootSpan != spans.end() && rootSpan->second.version == root->getVersion()) {
+            lastUpdate = UpdateStats{ 0, pages.size(), 0 };
+            return lastUpdate;
+        }
 
-public:
-    Document();  // Implementation moved after DraftState is defined
+        size_t oldCount = blocks.size();
+        size_t laidOutCount = 0;
+        size_t firstChange = 0;
+        size_t tail = 0;
+        if (laidOut && patch(root, laidOutCount)) {
+            firstChange = changedBlocks.empty() ? blocks.size() : changedBlocks.front().first;
+            tail = changedBlocks.empty() ? 0 : blocks.size() - 1 - changedBlocks.back().first;
+        }
+        else {
+            std::vector<Block> oldBlocks;
+            oldBlocks.swap(blocks);
+            blocks.reserve(oldBlocks.size());
+            collect(root, oldBlocks, laidOutCount);
+
+            // Unchanged prefix and suffix of the element sequence
+            size_t common = laidOut ? std::min(blocks.size(), oldBlocks.size()) : 0;
+            while (firstChange < common && blocks[firstChange].sameAs(oldBlocks[firstChange])) firstChange++;
+            while (tail < common - firstChange && blocks[blocks.size() - 1 - tail].sameAs(oldBlocks[oldBlocks.size() - 1 - tail])) tail++;
+        }
 
-    void setProperties(const std::string& ps, int mt, int mb, int ml, int mr,
-        const std::string& h, const std::string& f) {
-        pageSize = ps;
-        marginTop = mt; marginBottom = mb; marginLeft = ml; marginRight = mr;
-        header = h; footer = f;
+        if (laidOut && firstChange == blocks.size() && blocks.size() == oldCount) {
+            lastUpdate = UpdateStats{ laidOutCount, pages.size(), 0 };
+        }
+        else {
+            FlowState state = firstChange == 0 ? FlowState{ 0, 0 } : firstChange < starts.size() ? starts[firstChange] : end;
+            size_t firstPage = state.page;
+            // The changed middle of starts takes the new block count; the
+            // tail keeps its old starts for flow() to compare against
+            size_t oldMiddle = starts.size() - tail - firstChange;
+            size_t newMiddle = blocks.size() - tail - firstChange;
+            auto middle = starts.begin() + static_cast<ptrdiff_t>(firstChange);
+            if (newMiddle > oldMiddle) starts.insert(middle + static_cast<ptrdiff_t>(oldMiddle), newMiddle - oldMiddle, FlowState{ 0, 0 });
+            else starts.erase(middle + static_cast<ptrdiff_t>(newMiddle), middle + static_cast<ptrdiff_t>(oldMiddle));
+
+            size_t stop = flow(firstChange, blocks.size() - tail, state);
+            size_t lastPage = stop < blocks.size() ? starts[stop].page : end.page;
+            lastUpdate = UpdateStats{ laidOutCount, firstPage, lastPage + 1 - firstPage };
+            ptrdiff_t shift = static_cast<ptrdiff_t>(blocks.size()) - static_cast<ptrdiff_t>(oldCount);
+            if (stop < blocks.size() && shift != 0) {
+                // Rejoined the old flow: later pages carry over, renumbered
+                for (size_t p = lastPage + 1; p < pages.size(); ++p) {
+                    pages[p].firstBlock = static_cast<size_t>(static_cast<ptrdiff_t>(pages[p].firstBlock) + shift);
+                }
+            }
+        }
+        laidOut = true;
+
+        // Entries of elements that left the document
+        if (cache.size() > 2 * blocks.size() + 64) {
+            std::unordered_map<uint64_t, ElementLayout> live;
+            for (const Block& block : blocks) live.emplace(block.id, std::move(cache[block.id]));
+            cache.swap(live);
+            for (Block& block : blocks) block.layout = &cache[block.id];
+        }
+        pruneSpans(root);
+        return lastUpdate;
     }
 
-    void addElement(std::unique_ptr<DocumentElement> element) {
-        rootSection->add(std::move(element));
-        notifyObservers();
+    // Drops every cached layout, e.g. after font metrics change
+    void invalidate() {
+        cache.clear();
+        blocks.clear();
+        starts.clear();
+        pages.clear();
+        spans.clear();
+        liveSpans = 0;
+        end = FlowState{ 0, 0 };
+        laidOut = false;
     }
 
-    void draw(IRenderer* renderer) {
-        rootSection->draw(renderer);
+    const PageSetup& getPageSetup() const { return setup; }
+    const std::vector<PageLayout>& getPages() const { return pages; }
+    size_t pageCount() const { return pages.size(); }
+    const UpdateStats& getLastUpdate() const { return lastUpdate; }
+
+    // Page on which the element's first line sits; -1 if it is not laid out.
+    // A linear scan over the laid-out elements.
+    int pageOf(uint64_t elementId) const {
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            if (blocks[i].id == elementId) return static_cast<int>(starts[i].page) + (blockBreaksAtStart(i) ? 1 : 0);
+        }
+        return -1;
     }
 
-    Section* getRootSection() { return rootSection.get(); }
+    // Line breaks of a laid-out element; nullptr if it is not laid out
+    const std::vector<LineBox>* linesOf(uint64_t elementId) const {
+        auto found = cache.find(elementId);
+        return found == cache.end() ? nullptr : &found->second.lines;
+    }
 
-    // Observer pattern
-    void attach(IDocumentObserver* observer) {
-        observers.push_back(observer);
+private:
+    bool blockBreaksAtStart(size_t i) const {
+        size_t next = starts[i].page + 1;
+        return next < pages.size() && pages[next].firstBlock == i && pages[next].firstLine == 0;
     }
+};
 
-    void detach(IDocumentObserver* observer) {
-        observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+// [BRIDGE] - Retained rendering. Keeps the rendered output of every element
+// and section, keyed by ID and tagged with the version stamp it was drawn
+// at. Edits stamp the changed element and all its ancestors, which serves
+// as the dirty flag: a redraw re-renders only the stamped path and the
+// changed elements, and writes cached output for every clean subtree.
+// Output matches Document::draw. Only sections have entries: one chunk of
+// text holding the section's markers and the output of its non-section
+// children, plus the points where its child sections' entries are spliced
+// in. The cache holds each byte of output once, and re-rendering a section
+// copies only its own chunk, reusing clean children's slices of the old one.
+// Renderers that cannot render into another sink are drawn in full.
+class RetainedRenderer {
+public:
+    struct DrawStats {
+        size_t elementsRendered;  // Elements and sections drawn again
+        size_t subtreesReused;    // Clean subtrees taken from the cache
+        size_t bytes;             // Size of the output, less the root's markers
+    };
+
+private:
+    struct LeafSlice {
+        uint64_t id;
+        uint64_t version;
+        size_t begin;
+        size_t end;
+    };
+    // Entries live in an unordered_map, so pointers to them stay valid as
+    // the cache grows. A stale entry may point at erased ones, but only its
+    // text is read when it is rebuilt.
+    struct CachedOutput {
+        uint64_t version;
+        std::string text;                    // Markers and non-section children's output
+        std::vector<LeafSlice> leaves;       // Where each non-section child's output sits in text
+        std::vector<std::pair<size_t, const CachedOutput*>> sections;  // Child sections, spliced in at an offset of text
+        size_t markerBytes;
+        size_t bytes;                        // Output of the whole subtree
+    };
+
+    IRenderer* renderer;
+    std::unordered_map<uint64_t, CachedOutput> cache;
+    DrawStats lastDraw;
+
+    // Index of the child's slice in the old entry: usually the same
+    // position, otherwise found by a scan
+    static const LeafSlice* findSlice(const std::vector<LeafSlice>& old, size_t hint, const DocumentElement* child) {
+        if (hint < old.size() && old[hint].id == child->getId()) return &old[hint];
+        for (const LeafSlice& slice : old) {
+            if (slice.id == child->getId()) return &slice;
+        }
+        return nullptr;
     }
 
-    void notifyObservers() {
-        for (auto* observer : observers) {
-            observer->onDocumentChanged(this);
+    const CachedOutput& render(Section* section) {
+        CachedOutput& entry = cache[section->getId()];
+        if (entry.version == section->getVersion()) {
+            lastDraw.subtreesReused++;
+            return entry;
+        }
+        lastDraw.elementsRendered++;
+        MemorySink buffer;
+        auto local = renderer->createForSink(buffer);
+        std::string text;
+        std::vector<LeafSlice> leaves;
+        std::vector<std::pair<size_t, const CachedOutput*>> sections;
+        size_t bytes = 0;
+
+        local->startSection();
+        local->flush();
+        text = buffer.str();
+        size_t markerBytes = text.size();
+        for (auto& child : section->getChildren()) {
+            if (Section* inner = elementCast<Section>(child.get())) {
+                const CachedOutput& output = render(inner);
+                sections.emplace_back(text.size(), &output);
+                bytes += output.bytes;
+                continue;
+            }
+            size_t begin = text.size();
+            const LeafSlice* old = findSlice(entry.leaves, leaves.size(), child.get());
+            if (old && old->version == child->getVersion()) {
+                lastDraw.subtreesReused++;
+                text.append(entry.text, old->begin, old->end - old->begin);
+            }
+            else {
+                lastDraw.elementsRendered++;
+                buffer.clear();
+                child->draw(local.get());
+                local->flush();
+                text += buffer.str();
+            }
+            leaves.push_back(LeafSlice{ child->getId(), child->getVersion(), begin, text.size() });
         }
+        buffer.clear();
+        local->endSection();
+        local->flush();
+        text += buffer.str();
+        markerBytes += buffer.size();
+
+        entry.version = section->getVersion();
+        entry.text.swap(text);
+        entry.leaves.swap(leaves);
+        entry.sections.swap(sections);
+        entry.markerBytes = markerBytes;
+        entry.bytes = bytes + entry.text.size();
+        return entry;
     }
 
-    // State pattern
-    void setState(std::unique_ptr<class DocumentState> state);
-    void edit();
-    class DocumentState* getState() { return currentState.get(); }
-};
+    static void write(const CachedOutput& entry, OutputSink& out) {
+        size_t written = 0;
+        for (auto& splice : entry.sections) {
+            out.append(entry.text.data() + written, splice.first - written);
+            write(*splice.second, out);
+            written = splice.first;
+        }
+        out.append(entry.text.data() + written, entry.text.size() - written);
+    }
 
-// Builder build method implementation
-std::unique_ptr<Document> DocumentBuilder::build() {
-    auto doc = std::make_unique<Document>();
-    doc->setProperties(pageSize, marginTop, marginBottom, marginLeft, marginRight, header, footer);
-    return doc;
-}
+public:
+    explicit RetainedRenderer(IRenderer* target) : renderer(target), lastDraw{ 0, 0, 0 } {}
+
+    void draw(Document& doc) {
+        lastDraw = DrawStats{ 0, 0, 0 };
+        OutputSink* out = renderer->getSink();
+        std::unique_ptr<IRenderer> local = out ? renderer->createForSink(*out) : nullptr;
+        if (!local) {
+            lastDraw.elementsRendered = doc.indexedElementCount();
+            doc.draw(renderer);
+            return;
+        }
+        const CachedOutput& output = render(doc.getRootSection());
+        lastDraw.bytes = output.bytes - output.markerBytes;
+        write(output, *out);
+        renderer->flush();
+
+        // Forget elements that have left the document
+        if (cache.size() > 2 * doc.indexedElementCount() + 64) {
+            for (auto it = cache.begin(); it != cache.end();) {
+                if (doc.findElement(it->first)) ++it;
+                else it = cache.erase(it);
+            }
+        }
+    }
+
+    void invalidate() { cache.clear(); }
+
+    const DrawStats& getLastDraw() const { return lastDraw; }
+    size_t cachedBytes() const {
+        size_t bytes = 0;
+        for (auto& entry : cache) bytes += entry.second.text.size();
+        return bytes;
+    }
+};
 
 // [OBSERVER] - Concrete Observer (StatusBar)
+// Totals are seeded by one full count per document, then kept current from
+// change deltas, so a refresh costs O(changed elements)
 class StatusBar : public IDocumentObserver {
 private:
     int wordCount;
     int elementCount;
+    const Document* countedDocument;
+
+    void print() const {
+        std::cout << "[StatusBar] Elements: " << elementCount << " | Words: " << wordCount << std::endl;
+    }
 public:
-    StatusBar() : wordCount(0), elementCount(0) {}
+    StatusBar() : wordCount(0), elementCount(0), countedDocument(nullptr) {}
 
     void onDocumentChanged(Document* doc) override {
-        // Simple word count visitor could be used here
-        elementCount = 0;
-        wordCount = 0;
-        // Count elements (simplified)
-        countElements(doc->getRootSection());
-
-        std::cout << "[StatusBar] Elements: " << elementCount << " | Words: " << wordCount << std::endl;
+        ElementStats stats = measureChildren(doc->getRootSection());
+        elementCount = stats.elements;
+        wordCount = stats.words;
+        countedDocument = doc;
+        print();
     }
 
-    void countElements(Section* section) {
-        for (auto& child : section->getChildren()) {
-            elementCount++;
-            if (auto* para = dynamic_cast<Paragraph*>(child.get())) {
-                // Simple word count
-                std::istringstream iss(para->getContent());
-                std::string word;
-                while (iss >> word) wordCount++;
-            }
-            if (auto* sec = dynamic_cast<Section*>(child.get())) {
-                countElements(sec);
-            }
+    void onChangesApplied(Document* doc, const std::vector<DocumentChange>& changes) override {
+        if (doc != countedDocument) {
+            onDocumentChanged(doc);
+            return;
         }
+        for (auto& change : changes) {
+            elementCount += change.elementDelta;
+            wordCount += change.wordDelta;
+        }
+        print();
     }
+
+    int getWordCount() const { return wordCount; }
+    int getElementCount() const { return elementCount; }
 };
 
 // ==========================================================
@@ -474,119 +3525,465 @@ public:
     virtual ~DocumentState() = default;
 };
 
-class DraftState : public DocumentState {
-public:
-    void edit(Document* doc) override {
-        std::cout << "[State] Editing in Draft mode - all changes allowed\n";
+class DraftState : public DocumentState {
+public:
+    void edit(Document* doc) override {
+        std::cout << "[State] Editing in Draft mode - all changes allowed\n";
+    }
+    std::string getStateName() const override { return "Draft"; }
+};
+
+class ReviewState : public DocumentState {
+public:
+    void edit(Document* doc) override {
+        std::cout << "[State] Document in Review - limited editing allowed\n";
+    }
+    std::string getStateName() const override { return "Review"; }
+};
+
+class PublishedState : public DocumentState {
+public:
+    void edit(Document* doc) override {
+        std::cout << "[State] Document is Published - editing locked!\n";
+    }
+    std::string getStateName() const override { return "Published"; }
+};
+
+void Document::setState(std::unique_ptr<DocumentState> state) {
+    currentState = std::move(state);
+    std::cout << "[State] Document state changed to: " << currentState->getStateName() << std::endl;
+}
+
+void Document::edit() {
+    currentState->edit(this);
+}
+
+// Document constructor implementation (after DraftState is defined)
+Document::Document() : rootSection(std::make_unique<Section>("Root")), arena(nullptr), restoreCount(0), flatVersion(0), batchDepth(0),
+pageSize("A4"), marginTop(20), marginBottom(20),
+marginLeft(20), marginRight(20) {
+    setState(std::make_unique<DraftState>());
+    rootSection->attachIndex(&elementIndex);
+}
+
+// [MEMENTO] - Document State Snapshot
+// Holds the root of a persistent tree that shares unchanged subtrees with
+// the live document and with other mementos.
+class DocumentMemento {
+private:
+    SnapshotPtr state;
+    std::string stateName;
+public:
+    DocumentMemento(SnapshotPtr s, const std::string& sn)
+        : state(std::move(s)), stateName(sn) {
+    }
+
+    const SnapshotPtr& getState() const { return state; }
+    std::string getStateName() const { return stateName; }
+};
+
+// A checkpoint rebuilds only sections on paths changed since the last one
+DocumentMemento Document::createMemento() const {
+    return DocumentMemento(rootSection->snapshot(), currentState->getStateName());
+}
+
+std::unique_ptr<DocumentState> makeDocumentState(const std::string& name) {
+    if (name == "Review") return std::make_unique<ReviewState>();
+    if (name == "Published") return std::make_unique<PublishedState>();
+    return std::make_unique<DraftState>();
+}
+
+// Restores in place: the root section object stays and its contents are
+// rebuilt from the memento and indexed, so findElement() works straight
+// away. Restored elements keep the IDs they had when the memento was taken,
+// except where a live element already holds one, or where a copy had not
+// yet expanded its children; those get new IDs. Pointers to previous
+// elements other than the root become invalid, so commands made before the
+// restore are marked stale (see Command::isStale); CommandHistory looks
+// their elements up again by ID and drops only those whose elements are gone.
+void Document::restoreMemento(const DocumentMemento& memento) {
+    restoreCount++;
+    rootSection->restore(memento.getState());
+    if (currentState->getStateName() != memento.getStateName()) setState(makeDocumentState(memento.getStateName()));
+    notifyObservers();
+}
+
+// Rough heap footprint of a subtree, used to bound the undo history
+size_t approximateFootprint(const DocumentElement* element) {
+    if (!element) return 0;
+    struct Measure {
+        size_t operator()(const Paragraph& para) const {
+            return sizeof(Paragraph) + para.length() + para.getRuns().size() * sizeof(StyleRun);
+        }
+        size_t operator()(const Section& sec) const {
+            size_t bytes = sizeof(Section) + sec.getName().size();
+            if (sec.getPendingSnapshot()) return bytes;  // Contents are shared, not owned
+            for (auto& child : sec.getChildren()) {
+                bytes += sizeof(child) + approximateFootprint(child.get());
+            }
+            return bytes;
+        }
+        size_t operator()(const TextDecorator& decorator) const {
+            return sizeof(TextDecorator) + approximateFootprint(decorator.getWrapped());
+        }
+        size_t operator()(const Image& img) const { return sizeof(Image) + img.getPath().size(); }
+        size_t operator()(const ImageProxy& proxy) const { return sizeof(ImageProxy) + proxy.getPath().size(); }
+        size_t operator()(const DocumentElement&) const { return sizeof(Table); }
+    };
+    return dispatchElement(element, Measure());
+}
+
+// [COMMAND] - Command Pattern for Undo/Redo
+// Every command applies an exact inverse on undo. Detached subtrees are kept
+// by the command and reinserted as-is on redo, never cloned.
+class Command {
+protected:
+    Document* document;
+    uint64_t restoreCount;  // The document's restore count when the command was made
+
+    explicit Command(Document* doc) : document(doc), restoreCount(doc ? doc->getRestoreCount() : 0) {}
+
+    // Looks the elements the command works on up again by ID after a
+    // memento restore; false if any of them is gone
+    virtual bool rebind() { return false; }
+
+    template <typename T>
+    bool rebindTo(T*& target, uint64_t id) const {
+        target = document->findElementAs<T>(id);
+        return target != nullptr;
+    }
+
+    // Section and position of an element the command put in the document
+    bool locate(uint64_t id, Section*& section, uint64_t& sectionId, size_t& position) const {
+        DocumentElement* element = document->findElement(id);
+        section = element ? elementCast<Section>(element->getParent()) : nullptr;
+        if (!section) return false;
+        sectionId = section->getId();
+        position = section->indexOf(element);
+        return true;
+    }
+
+    // A detached subtree can go back in only if the restore brought none of
+    // its IDs back into the document
+    bool canReinsert(const DocumentElement* element) const {
+        std::vector<const DocumentElement*> pending{ element };
+        while (!pending.empty()) {
+            const DocumentElement* next = pending.back();
+            pending.pop_back();
+            if (document->findElement(next->getId())) return false;
+            if (auto* decorator = elementCast<TextDecorator>(next)) {
+                pending.push_back(decorator->getWrapped());
+            }
+            else if (auto* section = elementCast<Section>(next)) {
+                for (auto& child : section->getChildren()) pending.push_back(child.get());
+            }
+        }
+        return true;
+    }
+
+public:
+    virtual void execute() = 0;
+    virtual void undo() = 0;
+
+    // Bytes this command keeps alive, for the history's memory cap
+    virtual size_t footprint() const { return sizeof(Command); }
+
+    // A memento restore since the command was made (or last refreshed)
+    // replaced the elements it points at
+    bool isStale() const { return document && document->getRestoreCount() != restoreCount; }
+
+    // Re-resolves a stale command; false if it can no longer be applied
+    bool refresh() {
+        if (!isStale()) return true;
+        if (!rebind()) return false;
+        restoreCount = document->getRestoreCount();
+        return true;
+    }
+
+    virtual ~Command() = default;
+};
+
+class AddElementCommand : public Command {
+private:
+    Section* parent;
+    size_t index;
+    std::unique_ptr<DocumentElement> element;  // Held while not in the document
+    uint64_t parentId, elementId;
+
+    bool rebind() override {
+        if (!element) return locate(elementId, parent, parentId, index);
+        return (!parent || rebindTo(parent, parentId)) && canReinsert(element.get());
+    }
+public:
+    // Appends to the root section
+    AddElementCommand(Document* doc, std::unique_ptr<DocumentElement> el)
+        : Command(doc), parent(nullptr), index(0), element(std::move(el)), parentId(0), elementId(element ? element->getId() : 0) {
+    }
+
+    AddElementCommand(Document* doc, Section* target, size_t position, std::unique_ptr<DocumentElement> el)
+        : Command(doc), parent(target), index(position), element(std::move(el)),
+        parentId(target ? target->getId() : 0), elementId(element ? element->getId() : 0) {
+    }
+
+    void execute() override {
+        if (!element) return;
+        std::cout << "[Command] Executing: Add Element\n";
+        if (!parent) {
+            parent = document->getRootSection();
+            parentId = parent->getId();
+            index = parent->getChildren().size();
+        }
+        index = std::min(index, parent->getChildren().size());
+        document->insertElement(parent, index, std::move(element));
+    }
+
+    void undo() override {
+        if (element) return;
+        std::cout << "[Command] Undoing: Add Element\n";
+        element = document->removeElement(parent, index);
     }
-    std::string getStateName() const override { return "Draft"; }
+
+    size_t footprint() const override { return sizeof(*this) + approximateFootprint(element.get()); }
 };
 
-class ReviewState : public DocumentState {
+class RemoveElementCommand : public Command {
+private:
+    Section* parent;
+    size_t index;
+    std::unique_ptr<DocumentElement> element;  // Held while removed
+    uint64_t parentId, elementId;              // elementId is known once removed
+
+    bool rebind() override {
+        if (element) return rebindTo(parent, parentId) && canReinsert(element.get());
+        return elementId ? locate(elementId, parent, parentId, index) : rebindTo(parent, parentId);
+    }
 public:
-    void edit(Document* doc) override {
-        std::cout << "[State] Document in Review - limited editing allowed\n";
+    RemoveElementCommand(Document* doc, Section* target, size_t position)
+        : Command(doc), parent(target), index(position), parentId(target->getId()), elementId(0) {
     }
-    std::string getStateName() const override { return "Review"; }
+
+    void execute() override {
+        if (element) return;
+        std::cout << "[Command] Executing: Remove Element\n";
+        element = document->removeElement(parent, index);
+        if (element) elementId = element->getId();
+    }
+
+    void undo() override {
+        if (!element) return;
+        std::cout << "[Command] Undoing: Remove Element\n";
+        document->insertElement(parent, index, std::move(element));
+    }
+
+    size_t footprint() const override { return sizeof(*this) + approximateFootprint(element.get()); }
 };
 
-class PublishedState : public DocumentState {
+class MoveElementCommand : public Command {
+private:
+    Section* from;
+    size_t fromIndex;
+    Section* to;
+    size_t toIndex;
+    uint64_t fromId, toId, movedId;  // movedId is known once executed
+    bool moved;
+
+    // The moved element must still be in the section it was last moved to
+    bool rebind() override {
+        if (!rebindTo(from, fromId) || !rebindTo(to, toId)) return false;
+        if (!movedId) return true;
+        Section* section;
+        uint64_t sectionId;
+        size_t position;
+        if (!locate(movedId, section, sectionId, position) || section != (moved ? to : from)) return false;
+        if (moved) toIndex = position;
+        else fromIndex = position;
+        return true;
+    }
 public:
-    void edit(Document* doc) override {
-        std::cout << "[State] Document is Published - editing locked!\n";
+    // toIndex is the final position in the target section
+    MoveElementCommand(Document* doc, Section* source, size_t sourceIndex, Section* target, size_t targetIndex)
+        : Command(doc), from(source), fromIndex(sourceIndex), to(target), toIndex(targetIndex),
+        fromId(source->getId()), toId(target->getId()), movedId(0), moved(false) {
     }
-    std::string getStateName() const override { return "Published"; }
-};
 
-void Document::setState(std::unique_ptr<DocumentState> state) {
-    currentState = std::move(state);
-    std::cout << "[State] Document state changed to: " << currentState->getStateName() << std::endl;
-}
+    void execute() override {
+        std::cout << "[Command] Executing: Move Element\n";
+        auto& children = from->getChildren();
+        if (fromIndex < children.size()) movedId = children[fromIndex]->getId();
+        document->moveElement(from, fromIndex, to, toIndex);
+        moved = true;
+    }
 
-void Document::edit() {
-    currentState->edit(this);
-}
+    void undo() override {
+        std::cout << "[Command] Undoing: Move Element\n";
+        document->moveElement(to, toIndex, from, fromIndex);
+        moved = false;
+    }
 
-// Document constructor implementation (after DraftState is defined)
-Document::Document() : rootSection(std::make_unique<Section>("Root")),
-pageSize("A4"), marginTop(20), marginBottom(20),
-marginLeft(20), marginRight(20) {
-    setState(std::make_unique<DraftState>());
-}
+    size_t footprint() const override { return sizeof(*this); }
+};
 
-// [MEMENTO] - Document State Snapshot
-class DocumentMemento {
+class FormatCommand : public Command {
 private:
-    std::string state;
-    std::string stateName;
+    Paragraph* paragraph;
+    FormatHandle format;  // The format not currently applied
+    uint64_t paragraphId;
+
+    bool rebind() override { return rebindTo(paragraph, paragraphId); }
 public:
-    DocumentMemento(const std::string& s, const std::string& sn)
-        : state(s), stateName(sn) {
+    FormatCommand(Document* doc, Paragraph* para, FormatHandle fmt)
+        : Command(doc), paragraph(para), format(fmt), paragraphId(para->getId()) {
     }
 
-    std::string getState() const { return state; }
-    std::string getStateName() const { return stateName; }
-};
+    void execute() override {
+        std::cout << "[Command] Executing: Format Paragraph\n";
+        format = document->setFormat(paragraph, format);
+    }
 
-// [COMMAND] - Command Pattern for Undo/Redo
-class Command {
-public:
-    virtual void execute() = 0;
-    virtual void undo() = 0;
-    virtual ~Command() = default;
+    void undo() override {
+        std::cout << "[Command] Undoing: Format Paragraph\n";
+        format = document->setFormat(paragraph, format);
+    }
+
+    size_t footprint() const override { return sizeof(*this); }
 };
 
-class AddElementCommand : public Command {
+class StyleCommand : public Command {
 private:
-    Document* document;
-    std::unique_ptr<DocumentElement> element;
-    std::unique_ptr<DocumentElement> clonedElement;  // Keep a clone for redo
-    bool executed;
+    Paragraph* paragraph;
+    size_t offset, length;
+    FormatHandle format;
+    uint8_t styles;
+    StyleRuns previous;  // Runs before execute()
+    uint64_t paragraphId;
+
+    // The runs to put back on undo must still fit the restored text
+    bool rebind() override {
+        if (!rebindTo(paragraph, paragraphId)) return false;
+        return previous.empty() || previous.back().end() <= paragraph->getText().length();
+    }
 public:
-    AddElementCommand(Document* doc, std::unique_ptr<DocumentElement> el)
-        : document(doc), element(std::move(el)), executed(false) {
+    StyleCommand(Document* doc, Paragraph* para, size_t off, size_t len, FormatHandle fmt, uint8_t st)
+        : Command(doc), paragraph(para), offset(off), length(len), format(fmt), styles(st), paragraphId(para->getId()) {
     }
 
     void execute() override {
-        if (!executed) {
-            std::cout << "[Command] Executing: Add Element\n";
-            if (element) {
-                clonedElement = element->clone();  // Keep clone for potential redo
-                document->addElement(std::move(element));
-            }
-            else if (clonedElement) {
-                element = clonedElement->clone();
-                document->addElement(std::move(element));
-            }
-            executed = true;
-        }
+        std::cout << "[Command] Executing: Style Text\n";
+        previous = document->applyStyle(paragraph, offset, length, format, styles);
     }
 
     void undo() override {
-        std::cout << "[Command] Undoing: Add Element (simplified - not removing)\n";
-        // In real implementation, would remove the element
-        executed = false;
+        std::cout << "[Command] Undoing: Style Text\n";
+        document->setRuns(paragraph, std::move(previous));
+        previous.clear();
     }
+
+    size_t footprint() const override { return sizeof(*this) + previous.capacity() * sizeof(StyleRun); }
 };
 
+// Undo/redo stacks bounded by an approximate memory budget. Once it is
+// exceeded the oldest undo entries go first, then the furthest redo entries.
 class CommandHistory {
 private:
-    std::stack<std::unique_ptr<Command>> undoStack;
-    std::stack<std::unique_ptr<Command>> redoStack;
+    struct Entry {
+        std::unique_ptr<Command> command;
+        size_t bytes;
+    };
+
+    std::deque<Entry> undoStack;  // Oldest at the front
+    std::deque<Entry> redoStack;
+    size_t memoryLimit;
+    size_t memoryUsed;
+
+    // Optional checkpoint after every command; mementos share structure
+    Document* checkpointDocument;
+    size_t checkpointLimit;
+    std::deque<DocumentMemento> checkpoints;
+
+    void checkpoint() {
+        if (!checkpointDocument) return;
+        checkpoints.push_back(checkpointDocument->createMemento());
+        while (checkpoints.size() > checkpointLimit) checkpoints.pop_front();
+    }
+
+    void push(std::deque<Entry>& stack, std::unique_ptr<Command> cmd) {
+        size_t bytes = cmd->footprint();
+        memoryUsed += bytes;
+        stack.push_back(Entry{ std::move(cmd), bytes });
+    }
+
+    std::unique_ptr<Command> pop(std::deque<Entry>& stack) {
+        Entry entry = std::move(stack.back());
+        stack.pop_back();
+        memoryUsed -= entry.bytes;
+        return std::move(entry.command);
+    }
+
+    // After a memento restore, commands find their elements again by ID;
+    // those whose elements the restore did not bring back are dropped
+    bool dropStale() {
+        bool dropped = false;
+        for (std::deque<Entry>* stack : { &undoStack, &redoStack }) {
+            for (auto it = stack->begin(); it != stack->end();) {
+                if (!it->command->refresh()) {
+                    memoryUsed -= it->bytes;
+                    it = stack->erase(it);
+                    dropped = true;
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        if (dropped) std::cout << "[Command] Document was restored; dropped history for elements it removed\n";
+        return dropped;
+    }
+
+    // The latest undo entry is always kept so the last edit stays undoable
+    void enforceLimit() {
+        while (memoryUsed > memoryLimit) {
+            std::deque<Entry>* stack = undoStack.size() > 1 ? &undoStack
+                : !redoStack.empty() ? &redoStack : nullptr;
+            if (!stack) break;
+            memoryUsed -= stack->front().bytes;
+            stack->pop_front();
+        }
+    }
+
 public:
+    static constexpr size_t kDefaultMemoryLimit = 64u << 20;
+
+    explicit CommandHistory(size_t limitBytes = kDefaultMemoryLimit)
+        : memoryLimit(limitBytes), memoryUsed(0), checkpointDocument(nullptr), checkpointLimit(0) {
+    }
+
+    // Snapshot the document after every execute/undo/redo, keeping the latest `keep`
+    void enableCheckpoints(Document* doc, size_t keep = 100) {
+        checkpointDocument = doc;
+        checkpointLimit = keep;
+        checkpoint();
+    }
+
+    const std::deque<DocumentMemento>& getCheckpoints() const { return checkpoints; }
+
     void executeCommand(std::unique_ptr<Command> cmd) {
         cmd->execute();
-        undoStack.push(std::move(cmd));
         // Clear redo stack on new command
-        while (!redoStack.empty()) redoStack.pop();
+        while (!redoStack.empty()) pop(redoStack);
+        if (!undoStack.empty() && undoStack.front().command->isStale()) dropStale();
+        push(undoStack, std::move(cmd));
+        enforceLimit();
+        checkpoint();
     }
 
     void undo() {
+        if (!undoStack.empty() && undoStack.back().command->isStale()) dropStale();
         if (!undoStack.empty()) {
-            auto cmd = std::move(undoStack.top());
-            undoStack.pop();
+            auto cmd = pop(undoStack);
             cmd->undo();
-            redoStack.push(std::move(cmd));
+            push(redoStack, std::move(cmd));
+            enforceLimit();
+            checkpoint();
         }
         else {
             std::cout << "[Command] Nothing to undo\n";
@@ -594,16 +3991,27 @@ public:
     }
 
     void redo() {
+        if (!redoStack.empty() && redoStack.back().command->isStale()) dropStale();
         if (!redoStack.empty()) {
-            auto cmd = std::move(redoStack.top());
-            redoStack.pop();
+            auto cmd = pop(redoStack);
             cmd->execute();
-            undoStack.push(std::move(cmd));
+            push(undoStack, std::move(cmd));
+            enforceLimit();
+            checkpoint();
         }
         else {
             std::cout << "[Command] Nothing to redo\n";
         }
     }
+
+    void setMemoryLimit(size_t limitBytes) {
+        memoryLimit = limitBytes;
+        enforceLimit();
+    }
+
+    size_t getMemoryUsage() const { return memoryUsed; }
+    size_t undoCount() const { return undoStack.size(); }
+    size_t redoCount() const { return redoStack.size(); }
 };
 
 // [STRATEGY] - Export Strategies
@@ -649,6 +4057,8 @@ public:
     }
 };
 
+struct VariantSection;
+
 // [VISITOR] - Document Visitor Pattern
 class IDocumentVisitor {
 public:
@@ -656,7 +4066,12 @@ public:
     virtual void visitImage(Image* img) = 0;
     virtual void visitTable(Table* table) = 0;
     virtual void visitSection(Section* section) = 0;
+    // Called after a section's children have been visited
+    virtual void leaveSection(Section* section) {}
     virtual void visitImageProxy(ImageProxy* proxy) = 0;
+    // Sections of a VariantDocument, which have no Section object
+    virtual void visitVariantSection(VariantSection& section) {}
+    virtual void leaveVariantSection(VariantSection& section) {}
     virtual ~IDocumentVisitor() = default;
 };
 
@@ -666,10 +4081,12 @@ void Image::accept(IDocumentVisitor* visitor) { visitor->visitImage(this); }
 void Table::accept(IDocumentVisitor* visitor) { visitor->visitTable(this); }
 void ImageProxy::accept(IDocumentVisitor* visitor) { visitor->visitImageProxy(this); }
 void Section::accept(IDocumentVisitor* visitor) {
+    materialize();
     visitor->visitSection(this);
     for (auto& child : children) {
         child->accept(visitor);
     }
+    visitor->leaveSection(this);
 }
 
 class WordCountVisitor : public IDocumentVisitor {
@@ -679,9 +4096,7 @@ public:
     WordCountVisitor() : wordCount(0) {}
 
     void visitParagraph(Paragraph* para) override {
-        std::istringstream iss(para->getContent());
-        std::string word;
-        while (iss >> word) wordCount++;
+        wordCount += para->getWordCount();
     }
 
     void visitImage(Image* img) override { /* No words in image */ }
@@ -692,144 +4107,867 @@ public:
     int getWordCount() const { return wordCount; }
 };
 
+// Position of the first byte that needs an XML entity, or length. The SSE2
+// path tests 16 bytes per step, so clean text is skipped in bulk.
+inline size_t findXmlSpecial(const char* data, size_t length) {
+    size_t i = 0;
+#if defined(DOCUMENT_EDITOR_SSE2)
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"');
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, lt), _mm_cmpeq_epi8(bytes, gt)),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, amp), _mm_cmpeq_epi8(bytes, quot)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+        if (mask != 0) {
+#if defined(__GNUC__)
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+#else
+            while (!(mask & 1u)) { mask >>= 1; i++; }
+            return i;
+#endif
+        }
+    }
+#endif
+    for (; i < length; ++i) {
+        char c = data[i];
+        if (c == '<' || c == '>' || c == '&' || c == '"') return i;
+    }
+    return length;
+}
+
+// Appends text with <, >, & and " replaced by entities; runs without them
+// are copied in one append
+void appendEscapedXml(OutputSink& sink, const char* data, size_t length) {
+    while (length > 0) {
+        size_t clean = findXmlSpecial(data, length);
+        sink.append(data, clean);
+        if (clean == length) return;
+        switch (data[clean]) {
+        case '<': sink.append("&lt;", 4); break;
+        case '>': sink.append("&gt;", 4); break;
+        case '&': sink.append("&amp;", 5); break;
+        default: sink.append("&quot;", 6); break;
+        }
+        data += clean + 1;
+        length -= clean + 1;
+    }
+}
+
+// Streams XML into a sink while the tree is visited, so memory use stays
+// flat however large the document is. The default constructor collects the
+// output in memory for getXML().
 class XMLExportVisitor : public IDocumentVisitor {
 private:
-    std::ostringstream xml;
+    std::unique_ptr<MemorySink> ownedSink;
+    OutputSink* sink;
     int depth;
 
-    std::string indent() { return std::string(depth * 2, ' '); }
+    void indent() {
+        for (int i = 0; i < depth; ++i) sink->append("  ", 2);
+    }
+    void escaped(const std::string& text) { appendEscapedXml(*sink, text.data(), text.size()); }
+    void attribute(const char* name, const std::string& value) {
+        sink->append(' ');
+        sink->append(name);
+        sink->append("=\"", 2);
+        escaped(value);
+        sink->append('"');
+    }
+    void openSection(const std::string& name) {
+        indent();
+        sink->append("<section");
+        if (!name.empty()) attribute("name", name);
+        sink->append(">\n");
+        depth++;
+    }
+    void closeSection() {
+        depth--;
+        indent();
+        sink->append("</section>\n");
+    }
 public:
-    XMLExportVisitor() : depth(0) { xml << "<?xml version=\"1.0\"?>\n"; }
+    XMLExportVisitor() : ownedSink(std::make_unique<MemorySink>()), sink(ownedSink.get()), depth(0) {
+        sink->append("<?xml version=\"1.0\"?>\n");
+    }
+    explicit XMLExportVisitor(OutputSink& out) : sink(&out), depth(0) {
+        sink->append("<?xml version=\"1.0\"?>\n");
+    }
 
     void visitParagraph(Paragraph* para) override {
-        xml << indent() << "<paragraph>" << para->getContent() << "</paragraph>\n";
+        indent();
+        sink->append("<paragraph>");
+        if (para->getRuns().empty()) {
+            // Straight from the pieces, without flattening the text
+            para->getText().forEachChunk([&](const char* data, size_t n) { appendEscapedXml(*sink, data, n); });
+        }
+        else {
+            const PieceTable& text = para->getText();
+            forEachStyledSegment(text.length(), para->getRuns(), [&](size_t offset, size_t length, const StyleRun* run) {
+                bool bold = run && (run->styles & StyleRun::Bold);
+                bool italic = run && (run->styles & StyleRun::Italic);
+                if (bold) sink->append("<b>");
+                if (italic) sink->append("<i>");
+                text.forEachChunk(offset, length, [&](const char* data, size_t n) { appendEscapedXml(*sink, data, n); });
+                if (italic) sink->append("</i>");
+                if (bold) sink->append("</b>");
+            });
+        }
+        sink->append("</paragraph>\n");
     }
 
     void visitImage(Image* img) override {
-        xml << indent() << "<image src=\"" << img->getPath() << "\" />\n";
+        indent();
+        sink->append("<image");
+        attribute("src", img->getPath());
+        sink->append(" />\n");
     }
 
     void visitTable(Table* table) override {
-        xml << indent() << "<table />\n";
+        indent();
+        sink->append("<table rows=\"");
+        sink->append(table->getRows());
+        sink->append("\" cols=\"");
+        sink->append(table->getCols());
+        sink->append("\" />\n");
     }
 
-    void visitSection(Section* section) override {
-        xml << indent() << "<section>\n";
-        depth++;
-    }
+    void visitSection(Section* section) override { openSection(section->getName()); }
+    void leaveSection(Section* section) override { closeSection(); }
+    void visitVariantSection(VariantSection& section) override;
+    void leaveVariantSection(VariantSection& section) override { closeSection(); }
 
     void visitImageProxy(ImageProxy* proxy) override {
-        xml << indent() << "<image-proxy />\n";
+        indent();
+        sink->append("<image-proxy");
+        attribute("src", proxy->getPath());
+        sink->append(" />\n");
     }
 
-    std::string getXML() const { return xml.str(); }
+    void flush() { sink->flush(); }
+
+    // Output collected by the default constructor; empty when streaming to a sink
+    std::string getXML() const { return ownedSink ? ownedSink->str() : std::string(); }
 };
 
 // [ITERATOR] - Document Element Iterator
+// Walks the tree lazily in pre-order (descending into sections, not into
+// decorators) with an explicit stack of (section, child index) frames. The
+// first kInlineDepth levels live inside the iterator, so typical documents
+// are traversed without allocating. Editing the tree invalidates iterators.
 class DocumentIterator {
-private:
-    std::vector<DocumentElement*> elements;
-    size_t position;
+public:
+    class iterator {
+    private:
+        struct Frame {
+            const Section* section;
+            size_t index;
+            bool operator==(const Frame& other) const { return section == other.section && index == other.index; }
+        };
+        static constexpr size_t kInlineDepth = 16;
+
+        Frame inlineFrames[kInlineDepth];
+        std::vector<Frame> deepFrames;  // Levels past kInlineDepth
+        size_t depth;
+
+        Frame& top() { return depth <= kInlineDepth ? inlineFrames[depth - 1] : deepFrames.back(); }
+        const Frame& top() const { return depth <= kInlineDepth ? inlineFrames[depth - 1] : deepFrames.back(); }
+
+        void push(const Section* section) {
+            if (depth < kInlineDepth) inlineFrames[depth] = Frame{ section, 0 };
+            else deepFrames.push_back(Frame{ section, 0 });
+            depth++;
+        }
+        void pop() {
+            if (depth > kInlineDepth) deepFrames.pop_back();
+            depth--;
+        }
 
-    void collectElements(Section* section) {
-        for (auto& child : section->getChildren()) {
-            elements.push_back(child.get());
-            if (auto* sec = dynamic_cast<Section*>(child.get())) {
-                collectElements(sec);
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = DocumentElement;
+        using difference_type = std::ptrdiff_t;
+        using pointer = DocumentElement*;
+        using reference = DocumentElement&;
+
+        iterator() : depth(0) {}
+        explicit iterator(const Section* root) : depth(0) {
+            if (root && !root->getChildren().empty()) push(root);
+        }
+
+        reference operator*() const {
+            const Frame& frame = top();
+            return *frame.section->getChildren()[frame.index];
+        }
+        pointer operator->() const { return &**this; }
+
+        iterator& operator++() {
+            if (auto* sec = elementCast<Section>(&**this)) {
+                if (!sec->getChildren().empty()) {
+                    push(sec);
+                    return *this;
+                }
             }
+            while (depth > 0) {
+                Frame& frame = top();
+                if (++frame.index < frame.section->getChildren().size()) break;
+                pop();
+            }
+            return *this;
         }
-    }
+        iterator operator++(int) {
+            iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool operator==(const iterator& other) const {
+            return depth == other.depth && (depth == 0 || top() == other.top());
+        }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+    };
+
+private:
+    iterator first;
+    iterator position;
+
 public:
-    DocumentIterator(Document* doc) : position(0) {
-        collectElements(doc->getRootSection());
-    }
+    explicit DocumentIterator(const Section* root) : first(root), position(first) {}
+    DocumentIterator(Document* doc) : DocumentIterator(doc->getRootSection()) {}
+
+    iterator begin() const { return first; }
+    iterator end() const { return iterator(); }
 
-    bool hasNext() const { return position < elements.size(); }
+    bool hasNext() const { return position != end(); }
 
     DocumentElement* next() {
         if (hasNext()) {
-            return elements[position++];
+            return &*position++;
         }
         return nullptr;
     }
 
-    void reset() { position = 0; }
+    void reset() { position = first; }
 };
 
+#if __cplusplus >= 202002L
+static_assert(std::forward_iterator<DocumentIterator::iterator>);
+static_assert(std::ranges::forward_range<DocumentIterator>);
+#endif
+
 // [TEMPLATE METHOD] - Document Validator
 class DocumentValidator {
 public:
     bool validate() {
         std::cout << "[Validator] Starting validation...\n";
 
-        if (!checkStructure()) return false;
-        if (!checkSpelling()) return false;
-        if (!checkGrammar()) return false;
+        if (!checkStructure()) return false;
+        if (!checkSpelling()) return false;
+        if (!checkGrammar()) return false;
+
+        std::cout << "[Validator] Validation passed!\n";
+        return true;
+    }
+
+    virtual ~DocumentValidator() = default;
+
+protected:
+    virtual bool checkStructure() {
+        std::cout << "[Validator] Checking structure... OK\n";
+        return true;
+    }
+
+    virtual bool checkSpelling() = 0;  // Must be implemented
+    virtual bool checkGrammar() = 0;   // Must be implemented
+};
+
+class BasicValidator : public DocumentValidator {
+protected:
+    bool checkSpelling() override {
+        std::cout << "[Validator] Basic spell check... OK\n";
+        return true;
+    }
+
+    bool checkGrammar() override {
+        std::cout << "[Validator] Basic grammar check... OK\n";
+        return true;
+    }
+};
+
+class AdvancedValidator : public DocumentValidator {
+protected:
+    bool checkSpelling() override {
+        std::cout << "[Validator] Advanced spell check with dictionary... OK\n";
+        return true;
+    }
+
+    bool checkGrammar() override {
+        std::cout << "[Validator] Advanced grammar check with AI... OK\n";
+        return true;
+    }
+};
+
+// [FACADE] - Read-only view of a whole file, memory-mapped where available
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+    bool opened;
+#if defined(_WIN32)
+    std::vector<char> buffer;
+#endif
+public:
+    explicit MappedFile(const std::string& path) : bytes(nullptr), length(0), opened(false) {
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) return;
+        buffer.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), buffer.size());
+        bytes = buffer.data();
+        length = buffer.size();
+        opened = true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (::fstat(fd, &info) == 0) {
+            length = static_cast<size_t>(info.st_size);
+            opened = true;
+            if (length > 0) {
+                void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    opened = false;
+                    length = 0;
+                }
+                else {
+                    ::madvise(mapping, length, MADV_SEQUENTIAL);
+                    bytes = static_cast<const char*>(mapping);
+                }
+            }
+        }
+        ::close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#if !defined(_WIN32)
+        if (bytes) ::munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// [FACADE] - Streaming XML reader
+// SAX-style: the handler hears about elements and text as they are parsed,
+// so nothing proportional to the document is buffered. Input is a memory
+// range (e.g. a MappedFile) or a file descriptor read through a bounded
+// window. Text reaches the handler in pieces; only a single tag has to fit
+// in the window, which grows if one does not.
+struct XmlAttribute {
+    std::string name;
+    std::string value;  // Entities already decoded
+};
+
+class XmlSaxHandler {
+public:
+    virtual void startElement(const std::string& name, const std::vector<XmlAttribute>& attributes) = 0;
+    virtual void endElement(const std::string& name) = 0;
+    // Decoded character data; one text node may arrive over several calls
+    virtual void characters(const char* data, size_t length) = 0;
+    virtual ~XmlSaxHandler() = default;
+};
+
+class XmlSaxReader {
+private:
+    static constexpr size_t kMaxEntity = 12;  // "&#x10FFFF;" plus slack
+    static constexpr size_t kNotFound = SIZE_MAX;
+
+    const char* data;  // Current window; [pos, end) is unread
+    size_t pos, end;
+    int fd;            // -1 when reading from memory
+    std::vector<char> window;
+    bool eof;
+    uint64_t consumed;  // Bytes dropped from the front of the window
+    std::string errorMessage;
+
+    std::string name;
+    std::vector<XmlAttribute> attributes;
+    std::vector<std::string> openElements;
+    std::string scratch;
+
+    bool fail(const char* message) {
+        errorMessage = std::string(message) + " at byte " + std::to_string(consumed + pos);
+        return false;
+    }
+
+    // Moves the unread bytes to the front and reads more after them.
+    // Returns false once the input is exhausted.
+    bool fill() {
+        if (fd < 0 || eof) return false;
+        size_t keep = end - pos;
+        std::memmove(window.data(), window.data() + pos, keep);
+        consumed += pos;
+        pos = 0;
+        end = keep;
+        if (end == window.size()) window.resize(window.size() * 2);
+        data = window.data();
+        for (;;) {
+#if defined(_WIN32)
+            int n = ::_read(fd, window.data() + end, static_cast<unsigned>(window.size() - end));
+#else
+            ssize_t n = ::read(fd, window.data() + end, window.size() - end);
+            if (n < 0 && errno == EINTR) continue;
+#endif
+            if (n <= 0) {
+                eof = true;
+                return false;
+            }
+            end += static_cast<size_t>(n);
+            return true;
+        }
+    }
+
+    // Makes at least n unread bytes available if the input has them
+    void ensure(size_t n) {
+        while (end - pos < n && fill()) {}
+    }
+
+    static void appendUtf8(uint32_t code, std::string& out) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000) {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    // Decodes the entity body between '&' and ';'
+    static bool appendEntity(const char* begin, const char* stop, std::string& out) {
+        size_t n = static_cast<size_t>(stop - begin);
+        if (n == 2 && std::memcmp(begin, "lt", 2) == 0) out += '<';
+        else if (n == 2 && std::memcmp(begin, "gt", 2) == 0) out += '>';
+        else if (n == 3 && std::memcmp(begin, "amp", 3) == 0) out += '&';
+        else if (n == 4 && std::memcmp(begin, "quot", 4) == 0) out += '"';
+        else if (n == 4 && std::memcmp(begin, "apos", 4) == 0) out += '\'';
+        else if (n > 1 && begin[0] == '#') {
+            bool hex = begin[1] == 'x' || begin[1] == 'X';
+            const char* digit = begin + (hex ? 2 : 1);
+            if (digit == stop) return false;
+            uint32_t code = 0;
+            for (; digit < stop; ++digit) {
+                char c = *digit;
+                uint32_t value;
+                if (c >= '0' && c <= '9') value = static_cast<uint32_t>(c - '0');
+                else if (hex && c >= 'a' && c <= 'f') value = static_cast<uint32_t>(c - 'a' + 10);
+                else if (hex && c >= 'A' && c <= 'F') value = static_cast<uint32_t>(c - 'A' + 10);
+                else return false;
+                code = code * (hex ? 16 : 10) + value;
+                if (code > 0x10FFFF) return false;
+            }
+            // NUL and UTF-16 surrogates are not XML characters
+            if (code == 0 || (code >= 0xD800 && code <= 0xDFFF)) return false;
+            appendUtf8(code, out);
+        }
+        else return false;
+        return true;
+    }
+
+    static bool decodeInto(const char* begin, const char* stop, std::string& out) {
+        out.clear();
+        while (begin < stop) {
+            const char* amp = static_cast<const char*>(std::memchr(begin, '&', static_cast<size_t>(stop - begin)));
+            if (!amp) {
+                out.append(begin, stop);
+                break;
+            }
+            out.append(begin, amp);
+            const char* semi = static_cast<const char*>(std::memchr(amp, ';', static_cast<size_t>(stop - amp)));
+            if (!semi || !appendEntity(amp + 1, semi, out)) return false;
+            begin = semi + 1;
+        }
+        return true;
+    }
+
+    static bool isNameEnd(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '/' || c == '>' || c == '='; }
+    static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+    // Offset from pos of the '>' closing the tag at pos, skipping quoted values
+    size_t findTagEnd() {
+        char quote = 0;
+        for (size_t i = 1;; ++i) {
+            if (pos + i >= end && !fill()) return kNotFound;
+            char c = data[pos + i];
+            if (quote) {
+                if (c == quote) quote = 0;
+            }
+            else if (c == '"' || c == '\'') quote = c;
+            else if (c == '>') return i;
+        }
+    }
+
+    // Offset from pos just past the terminator, refilling as needed
+    size_t findTerminator(const char* terminator, size_t from) {
+        size_t n = std::strlen(terminator);
+        for (;;) {
+            const char* hit = std::search(data + pos + from, data + end, terminator, terminator + n);
+            if (hit != data + end) return static_cast<size_t>(hit - (data + pos)) + n;
+            from = end - pos >= n ? end - pos - n + 1 : 0;
+            if (!fill()) return kNotFound;
+        }
+    }
+
+    bool parseText(XmlSaxHandler& handler) {
+        while (pos < end || fill()) {
+            char c = data[pos];
+            if (c == '<') return true;
+            if (c == '&') {
+                ensure(kMaxEntity);
+                size_t limit = std::min(end - pos, kMaxEntity);
+                const char* semi = static_cast<const char*>(std::memchr(data + pos, ';', limit));
+                scratch.clear();
+                if (!semi || !appendEntity(data + pos + 1, semi, scratch)) return fail("bad entity reference");
+                handler.characters(scratch.data(), scratch.size());
+                pos = static_cast<size_t>(semi - data) + 1;
+                continue;
+            }
+            // A clean run up to the next markup or entity goes out in one call
+            size_t stop = end;
+            if (const void* lt = std::memchr(data + pos, '<', stop - pos)) stop = static_cast<size_t>(static_cast<const char*>(lt) - data);
+            if (const void* amp = std::memchr(data + pos, '&', stop - pos)) stop = static_cast<size_t>(static_cast<const char*>(amp) - data);
+            handler.characters(data + pos, stop - pos);
+            pos = stop;
+        }
+        return true;
+    }
+
+    // Parses "<name attr="value" ...>" spanning [pos, pos + close]
+    bool parseStartTag(size_t close, bool& selfClosing) {
+        const char* p = data + pos + 1;
+        const char* stop = data + pos + close;
+        selfClosing = stop > p && stop[-1] == '/';
+        if (selfClosing) stop--;
+        const char* nameEnd = p;
+        while (nameEnd < stop && !isNameEnd(*nameEnd)) nameEnd++;
+        if (nameEnd == p) return fail("missing element name");
+        name.assign(p, nameEnd);
+        attributes.clear();
+        p = nameEnd;
+        for (;;) {
+            while (p < stop && isBlank(*p)) p++;
+            if (p == stop) break;
+            const char* attrEnd = p;
+            while (attrEnd < stop && !isNameEnd(*attrEnd)) attrEnd++;
+            if (attrEnd == p) return fail("malformed attribute");
+            XmlAttribute attribute;
+            attribute.name.assign(p, attrEnd);
+            p = attrEnd;
+            while (p < stop && isBlank(*p)) p++;
+            if (p == stop || *p != '=') return fail("attribute without value");
+            p++;
+            while (p < stop && isBlank(*p)) p++;
+            if (p == stop || (*p != '"' && *p != '\'')) return fail("unquoted attribute value");
+            char quote = *p++;
+            const char* valueEnd = static_cast<const char*>(std::memchr(p, quote, static_cast<size_t>(stop - p)));
+            if (!valueEnd || !decodeInto(p, valueEnd, attribute.value)) return fail("malformed attribute value");
+            attributes.push_back(std::move(attribute));
+            p = valueEnd + 1;
+        }
+        return true;
+    }
+
+public:
+    static constexpr size_t kWindowSize = 64 * 1024;
+
+    // Parses a complete document held in memory, without copying it
+    XmlSaxReader(const char* bytes, size_t length)
+        : data(bytes), pos(0), end(length), fd(-1), eof(true), consumed(0) {
+    }
+
+    // Streams from a descriptor through a window of the given size
+    explicit XmlSaxReader(int descriptor, size_t windowSize = kWindowSize)
+        : data(nullptr), pos(0), end(0), fd(descriptor), window(std::max<size_t>(windowSize, 64)),
+        eof(false), consumed(0) {
+        data = window.data();
+    }
+
+    bool parse(XmlSaxHandler& handler) {
+        for (;;) {
+            if (pos == end && !fill()) break;
+            if (data[pos] != '<') {
+                if (!parseText(handler)) return false;
+                continue;
+            }
+            ensure(9);
+            size_t available = end - pos;
+            if (available >= 4 && std::memcmp(data + pos, "<!--", 4) == 0) {
+                size_t after = findTerminator("-->", 4);
+                if (after == kNotFound) return fail("unterminated comment");
+                pos += after;
+                continue;
+            }
+            if (available >= 9 && std::memcmp(data + pos, "<![CDATA[", 9) == 0) {
+                size_t after = findTerminator("]]>", 9);
+                if (after == kNotFound) return fail("unterminated CDATA section");
+                handler.characters(data + pos + 9, after - 12);
+                pos += after;
+                continue;
+            }
+            if (available >= 2 && data[pos + 1] == '?') {
+                size_t after = findTerminator("?>", 2);
+                if (after == kNotFound) return fail("unterminated processing instruction");
+                pos += after;
+                continue;
+            }
+            size_t close = findTagEnd();
+            if (close == kNotFound) return fail("unterminated tag");
+            if (data[pos + 1] == '!') {
+                pos += close + 1;  // DOCTYPE and other declarations carry no content
+                continue;
+            }
+            if (data[pos + 1] == '/') {
+                const char* p = data + pos + 2;
+                const char* stop = data + pos + close;
+                while (stop > p && isBlank(stop[-1])) stop--;
+                name.assign(p, stop);
+                if (openElements.empty() || openElements.back() != name) return fail("mismatched end tag");
+                openElements.pop_back();
+                pos += close + 1;
+                handler.endElement(name);
+                continue;
+            }
+            bool selfClosing = false;
+            if (!parseStartTag(close, selfClosing)) return false;
+            pos += close + 1;
+            handler.startElement(name, attributes);
+            if (selfClosing) handler.endElement(name);
+            else openElements.push_back(name);
+        }
+        if (!openElements.empty()) return fail("unclosed element");
+        return true;
+    }
+
+    const std::string& error() const { return errorMessage; }
+};
 
-        std::cout << "[Validator] Validation passed!\n";
-        return true;
+// Rebuilds document elements from XMLExportVisitor output while it is
+// parsed. The outermost <section> becomes the document root. Unknown
+// elements, and anything but <b>/<i> inside a paragraph, are skipped along
+// with everything they contain.
+class DocumentXmlBuilder : public XmlSaxHandler {
+private:
+    Document* document;
+    std::vector<Section*> sections;
+    bool inParagraph;
+    std::string text;
+    StyleRuns runs;
+    int boldDepth;    // Open <b>/<i> inside the current paragraph
+    int italicDepth;
+    int skipDepth;    // Open elements inside a skipped one, including it
+    int skipped;
+
+    uint8_t styles() const {
+        return static_cast<uint8_t>((boldDepth > 0 ? StyleRun::Bold : 0) | (italicDepth > 0 ? StyleRun::Italic : 0));
     }
 
-    virtual ~DocumentValidator() = default;
+    void skip() {
+        skipDepth = 1;
+        skipped++;
+    }
 
-protected:
-    virtual bool checkStructure() {
-        std::cout << "[Validator] Checking structure... OK\n";
-        return true;
+    static const std::string* find(const std::vector<XmlAttribute>& attributes, const char* name) {
+        for (auto& attribute : attributes) {
+            if (attribute.name == name) return &attribute.value;
+        }
+        return nullptr;
+    }
+    static std::string value(const std::vector<XmlAttribute>& attributes, const char* name) {
+        const std::string* found = find(attributes, name);
+        return found ? *found : std::string();
     }
 
-    virtual bool checkSpelling() = 0;  // Must be implemented
-    virtual bool checkGrammar() = 0;   // Must be implemented
-};
+    Section* current() {
+        if (sections.empty()) sections.push_back(document->getRootSection());
+        return sections.back();
+    }
 
-class BasicValidator : public DocumentValidator {
-protected:
-    bool checkSpelling() override {
-        std::cout << "[Validator] Basic spell check... OK\n";
-        return true;
+public:
+    explicit DocumentXmlBuilder(Document* doc)
+        : document(doc), inParagraph(false), boldDepth(0), italicDepth(0), skipDepth(0), skipped(0) {
     }
 
-    bool checkGrammar() override {
-        std::cout << "[Validator] Basic grammar check... OK\n";
-        return true;
+    void startElement(const std::string& name, const std::vector<XmlAttribute>& attributes) override {
+        if (skipDepth > 0) {
+            skipDepth++;
+            return;
+        }
+        if (inParagraph) {
+            if (name == "b") boldDepth++;
+            else if (name == "i") italicDepth++;
+            else skip();
+            return;
+        }
+        if (name == "section") {
+            if (sections.empty()) {
+                Section* root = document->getRootSection();
+                std::string rootName = value(attributes, "name");
+                if (rootName != root->getName()) root->setName(std::move(rootName));
+                sections.push_back(root);
+                return;
+            }
+            auto section = std::make_unique<Section>(value(attributes, "name"));
+            Section* raw = section.get();
+            current()->add(std::move(section));
+            sections.push_back(raw);
+        }
+        else if (name == "paragraph") {
+            inParagraph = true;
+            text.clear();
+            runs.clear();
+            boldDepth = 0;
+            italicDepth = 0;
+        }
+        else if (name == "image") {
+            current()->add(std::make_unique<Image>(value(attributes, "src")));
+        }
+        else if (name == "image-proxy") {
+            current()->add(std::make_unique<ImageProxy>(value(attributes, "src")));
+        }
+        else if (name == "table") {
+            current()->add(std::make_unique<Table>(std::atoi(value(attributes, "rows").c_str()),
+                std::atoi(value(attributes, "cols").c_str())));
+        }
+        else {
+            skip();
+        }
     }
-};
 
-class AdvancedValidator : public DocumentValidator {
-protected:
-    bool checkSpelling() override {
-        std::cout << "[Validator] Advanced spell check with dictionary... OK\n";
-        return true;
+    void endElement(const std::string& name) override {
+        if (skipDepth > 0) {
+            skipDepth--;
+            return;
+        }
+        if (inParagraph) {
+            if (name == "b") boldDepth--;
+            else if (name == "i") italicDepth--;
+            else if (name == "paragraph") {
+                current()->add(std::make_unique<Paragraph>(PieceTable(text), kNoFormat, runs));
+                inParagraph = false;
+            }
+            return;
+        }
+        if (name == "section" && !sections.empty()) sections.pop_back();
     }
 
-    bool checkGrammar() override {
-        std::cout << "[Validator] Advanced grammar check with AI... OK\n";
-        return true;
+    void characters(const char* data, size_t length) override {
+        if (!inParagraph || skipDepth > 0) return;  // Indentation between elements
+        uint8_t styles = this->styles();
+        if (styles != 0) {
+            uint32_t offset = static_cast<uint32_t>(text.size());
+            if (!runs.empty() && runs.back().end() == offset && runs.back().styles == styles) {
+                runs.back().length += static_cast<uint32_t>(length);
+            }
+            else {
+                runs.push_back(StyleRun{ offset, static_cast<uint32_t>(length), kNoFormat, styles });
+            }
+        }
+        text.append(data, length);
     }
+
+    int getSkipped() const { return skipped; }
 };
 
 // [FACADE] - File Manager Facade
+// Documents are stored in a compact binary format laid out for direct
+// mapping: a fixed header, a CharacterFormat table, one fixed-size record
+// per node in document order, the paragraphs' style runs, then a single blob
+// holding all strings.
+// Integers are stored in host byte order.
 class FileManagerFacade {
-public:
-    void save(Document* doc, const std::string& path) {
-        std::cout << "[Facade] Saving document to: " << path << std::endl;
-        // Simplified: In real implementation, would serialize to JSON/XML
-        std::ofstream file(path);
-        if (file.is_open()) {
-            file << "Document content saved\n";
-            file.close();
-            std::cout << "[Facade] Document saved successfully!\n";
-        }
-    }
+private:
+    static constexpr uint32_t kMagic = 0x46454453;  // "SDEF"
+    static constexpr uint32_t kVersion = 2;
+
+    struct StringRef {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nodeCount;
+        uint32_t formatCount;
+        uint32_t runCount;
+        uint32_t reserved;
+        uint64_t stringBytes;
+        int32_t margins[4];       // Top, bottom, left, right
+        StringRef pageSize;
+        StringRef header;
+        StringRef footer;
+    };
+
+    struct FormatRecord {
+        StringRef font;
+        StringRef color;
+        int32_t size;
+        uint32_t reserved;
+    };
+
+    struct NodeRecord {
+        uint8_t kind;             // ElementKind
+        uint8_t reserved[3];
+        uint32_t parent;          // Index of an earlier record; root has none
+        StringRef text;           // Paragraph text, section name or image path
+        uint32_t format;          // 1-based FormatRecord index, 0 for none
+        int32_t values[4];        // Table rows/cols, shape geometry or paragraph first run/run count
+        uint32_t reserved2;
+    };
+
+    struct RunRecord {
+        uint32_t offset;
+        uint32_t length;
+        uint32_t format;          // 1-based FormatRecord index, 0 for none
+        uint8_t styles;
+        uint8_t reserved[3];
+    };
+
+    static_assert(sizeof(FileHeader) % 8 == 0, "records must keep 8-byte alignment");
+    static_assert(sizeof(FormatRecord) % 8 == 0, "records must keep 8-byte alignment");
+    static_assert(sizeof(NodeRecord) % 8 == 0, "records must keep 8-byte alignment");
+    static_assert(sizeof(RunRecord) % 8 == 0, "records must keep 8-byte alignment");
+
+    std::unique_ptr<Document> importXml(XmlSaxReader& reader, const std::string& source);
 
-    std::unique_ptr<Document> load(const std::string& path) {
-        std::cout << "[Facade] Loading document from: " << path << std::endl;
-        // Simplified: In real implementation, would deserialize from JSON/XML
-        auto doc = std::make_unique<Document>();
-        doc->addElement(ElementFactory::createParagraph("Loaded content"));
-        std::cout << "[Facade] Document loaded successfully!\n";
-        return doc;
-    }
+public:
+    void save(Document* doc, const std::string& path);
+    // Reads the binary format or an XML export, detected from the content
+    std::unique_ptr<Document> load(const std::string& path);
+
+    // XML exports, written with XMLExportVisitor; loadXml streams from any
+    // descriptor, including pipes
+    void saveXml(Document* doc, const std::string& path);
+    std::unique_ptr<Document> loadXml(int fd);
 };
 
 // [ADAPTER] - Legacy Shape Drawer Adapter
@@ -846,7 +4984,9 @@ private:
     LegacyShapeDrawer legacyDrawer;
     int x, y, width, height;
 public:
-    ShapeAdapter(int x, int y, int w, int h) : x(x), y(y), width(w), height(h) {}
+    static bool classof(ElementKind kind) { return kind == ElementKind::Shape; }
+
+    ShapeAdapter(int x, int y, int w, int h) : DocumentElement(ElementKind::Shape), x(x), y(y), width(w), height(h) {}
 
     void draw(IRenderer* renderer) override {
         std::cout << "[Adapter] Adapting legacy shape to modern interface...\n";
@@ -862,6 +5002,10 @@ public:
     }
 
     std::string getType() const override { return "Shape"; }
+    int getX() const { return x; }
+    int getY() const { return y; }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
 };
 
 // [CHAIN OF RESPONSIBILITY] - Event Handler Chain (Optional)
@@ -917,7 +5061,7 @@ public:
         std::cout << "[Mediator] Menu '" << menu << "' clicked, coordinating UI...\n";
         if (menu == "save") {
             FileManagerFacade facade;
-            facade.save(document, "document.txt");
+            facade.save(document, "document.sdoc");
         }
     }
 
@@ -956,10 +5100,954 @@ public:
     }
 };
 
+// ==========================================================
+// FLAT DOCUMENT STORE
+// ==========================================================
+
+// Compact read-only copy of a document tree: nodes live in parallel arrays
+// in document (pre-)order, linked by parent / first-child / next-sibling
+// indices, and each node's payload handle indexes a per-kind table of element
+// objects. Whole-document passes (draw, visitors, counts, save) are linear
+// scans over the arrays instead of a virtual call and pointer chase per
+// node. It is not a Document backend: edits go to the element tree, and a
+// store is built from a tree (or appended in order) when it is needed.
+class FlatDocumentStore {
+public:
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+private:
+    std::vector<ElementKind> kinds;
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> firstChildren;
+    std::vector<uint32_t> nextSiblings;
+    std::vector<uint32_t> lastChildren;   // O(1) append
+    std::vector<uint32_t> subtreeEnds;    // One past the last descendant
+    std::vector<uint32_t> payloads;
+
+    // Per-kind payload tables. Visitors and draw() take non-const elements,
+    // so the stored objects are handed out from const passes; they are only
+    // read. Sections are stored by name only, their children are the arrays.
+    mutable std::deque<Paragraph> paragraphs;
+    mutable std::deque<Section> sections;
+    mutable std::deque<Image> images;
+    mutable std::deque<ImageProxy> proxies;
+    mutable std::deque<Table> tables;
+    mutable std::deque<ShapeAdapter> shapes;
+    std::vector<std::unique_ptr<DocumentElement>> opaques;  // Types without a flat encoding
+
+    uint32_t append(ElementKind kind, uint32_t parent, uint32_t payload) {
+        uint32_t index = static_cast<uint32_t>(kinds.size());
+        kinds.push_back(kind);
+        parents.push_back(parent);
+        firstChildren.push_back(kNone);
+        nextSiblings.push_back(kNone);
+        lastChildren.push_back(kNone);
+        subtreeEnds.push_back(index + 1);
+        payloads.push_back(payload);
+        if (parent != kNone) {
+            if (lastChildren[parent] == kNone) firstChildren[parent] = index;
+            else nextSiblings[lastChildren[parent]] = index;
+            lastChildren[parent] = index;
+            for (uint32_t p = parent; p != kNone; p = parents[p]) subtreeEnds[p] = index + 1;
+        }
+        return index;
+    }
+
+    template <typename T>
+    static uint32_t lastOf(const std::deque<T>& table) { return static_cast<uint32_t>(table.size() - 1); }
+
+    void flatten(const DocumentElement* element, uint32_t parent) {
+        switch (element->getKind()) {
+        case ElementKind::Paragraph: {
+            auto* para = static_cast<const Paragraph*>(element);
+            appendParagraph(parent, para->getText(), para->getFormatHandle(), para->getRuns());
+            break;
+        }
+        case ElementKind::Section: {
+            auto* sec = static_cast<const Section*>(element);
+            uint32_t index = appendSection(parent, sec->getName());
+            for (auto& child : sec->getChildren()) flatten(child.get(), index);
+            break;
+        }
+        case ElementKind::Image:
+            appendImage(parent, static_cast<const Image*>(element)->getPath());
+            break;
+        case ElementKind::Table: {
+            auto* table = static_cast<const Table*>(element);
+            appendTable(parent, table->getRows(), table->getCols());
+            break;
+        }
+        case ElementKind::ImageProxy:
+            appendImageProxy(parent, static_cast<const ImageProxy*>(element)->getPath());
+            break;
+        case ElementKind::Bold:
+        case ElementKind::Italic:
+            flatten(static_cast<const TextDecorator*>(element)->getWrapped(), appendDecorator(parent, element->getKind()));
+            break;
+        case ElementKind::Shape: {
+            auto* shape = static_cast<const ShapeAdapter*>(element);
+            appendShape(parent, shape->getX(), shape->getY(), shape->getWidth(), shape->getHeight());
+            break;
+        }
+        case ElementKind::Opaque:
+            appendOpaque(parent, element->clone());
+            break;
+        }
+    }
+
+public:
+    // Starts with an empty root section at index 0
+    explicit FlatDocumentStore(const std::string& rootName = "Root") {
+        appendSection(kNone, rootName);
+    }
+
+    explicit FlatDocumentStore(const Section& root) {
+        uint32_t index = appendSection(kNone, root.getName());
+        for (auto& child : root.getChildren()) flatten(child.get(), index);
+    }
+
+    FlatDocumentStore(const FlatDocumentStore&) = delete;
+    FlatDocumentStore& operator=(const FlatDocumentStore&) = delete;
+
+    // Builders. Nodes must be appended in document order: a parent is
+    // always the most recently opened node whose subtree is still growing.
+    uint32_t appendSection(uint32_t parent, const std::string& name) {
+        sections.emplace_back(name);
+        return append(ElementKind::Section, parent, lastOf(sections));
+    }
+    uint32_t appendParagraph(uint32_t parent, const PieceTable& text,
+        FormatHandle format = kNoFormat, StyleRuns runs = StyleRuns()) {
+        paragraphs.emplace_back(text, format, std::move(runs));
+        return append(ElementKind::Paragraph, parent, lastOf(paragraphs));
+    }
+    uint32_t appendImage(uint32_t parent, const std::string& path) {
+        images.emplace_back(path);
+        return append(ElementKind::Image, parent, lastOf(images));
+    }
+    uint32_t appendImageProxy(uint32_t parent, const std::string& path) {
+        proxies.emplace_back(path);
+        return append(ElementKind::ImageProxy, parent, lastOf(proxies));
+    }
+    uint32_t appendTable(uint32_t parent, int rows, int cols) {
+        tables.emplace_back(rows, cols);
+        return append(ElementKind::Table, parent, lastOf(tables));
+    }
+    uint32_t appendDecorator(uint32_t parent, ElementKind style) {
+        return append(style, parent, kNone);
+    }
+    uint32_t appendShape(uint32_t parent, int x, int y, int width, int height) {
+        shapes.emplace_back(x, y, width, height);
+        return append(ElementKind::Shape, parent, lastOf(shapes));
+    }
+    uint32_t appendOpaque(uint32_t parent, std::unique_ptr<DocumentElement> element) {
+        opaques.push_back(std::move(element));
+        return append(ElementKind::Opaque, parent, static_cast<uint32_t>(opaques.size() - 1));
+    }
+
+    // Raw structure access
+    size_t size() const { return kinds.size(); }
+    ElementKind kind(uint32_t i) const { return kinds[i]; }
+    uint32_t parent(uint32_t i) const { return parents[i]; }
+    uint32_t firstChild(uint32_t i) const { return firstChildren[i]; }
+    uint32_t nextSibling(uint32_t i) const { return nextSiblings[i]; }
+    uint32_t subtreeEnd(uint32_t i) const { return subtreeEnds[i]; }
+    uint32_t payload(uint32_t i) const { return payloads[i]; }
+
+    const Paragraph& paragraphAt(uint32_t i) const { return paragraphs[payloads[i]]; }
+    const Section& sectionAt(uint32_t i) const { return sections[payloads[i]]; }
+    const Image& imageAt(uint32_t i) const { return images[payloads[i]]; }
+    const ImageProxy& imageProxyAt(uint32_t i) const { return proxies[payloads[i]]; }
+    const Table& tableAt(uint32_t i) const { return tables[payloads[i]]; }
+    const ShapeAdapter& shapeAt(uint32_t i) const { return shapes[payloads[i]]; }
+    DocumentElement* opaqueAt(uint32_t i) const { return opaques[payloads[i]].get(); }
+
+    // Section name or image path
+    const std::string& stringAt(uint32_t i) const {
+        switch (kinds[i]) {
+        case ElementKind::Image: return imageAt(i).getPath();
+        case ElementKind::ImageProxy: return imageProxyAt(i).getPath();
+        default: return sectionAt(i).getName();
+        }
+    }
+
+    std::string typeName(uint32_t i) const {
+        switch (kinds[i]) {
+        case ElementKind::Opaque: return opaqueAt(i)->getType();
+        case ElementKind::Bold:
+        case ElementKind::Italic:
+            return firstChildren[i] == kNone ? "Decorator" : typeName(firstChildren[i]);
+        default:
+            return elementKindName(kinds[i]);
+        }
+        return "Unknown";
+    }
+
+    // Elements below the root in document order, like DocumentIterator
+    // (decorated elements are not listed separately from their decorator)
+    template <typename F>
+    void forEach(F fn) const {
+        for (uint32_t i = 1; i < kinds.size(); ++i) {
+            fn(i);
+            if (kinds[i] == ElementKind::Bold || kinds[i] == ElementKind::Italic) i = subtreeEnds[i] - 1;
+        }
+    }
+
+    int countElements() const {
+        int count = 0;
+        forEach([&](uint32_t) { count++; });
+        return count;
+    }
+
+    int countWords() const {
+        int count = 0;
+        for (const Paragraph& para : paragraphs) count += para.getWordCount();
+        return count;
+    }
+
+    void drawRange(uint32_t begin, IRenderer* renderer) const;
+    void acceptRange(uint32_t begin, IDocumentVisitor* visitor) const;
+    std::unique_ptr<DocumentElement> materialize(uint32_t index) const;
+    std::unique_ptr<class FlatElementView> view(uint32_t index) const;
+
+    void draw(IRenderer* renderer) const { drawRange(0, renderer); }
+    void accept(IDocumentVisitor* visitor) const { acceptRange(0, visitor); }
+
+    std::unique_ptr<Section> toSection() const {
+        auto root = std::make_unique<Section>(sectionAt(0).getName());
+        for (uint32_t c = firstChildren[0]; c != kNone; c = nextSiblings[c]) root->add(materialize(c));
+        return root;
+    }
+};
+
+// DocumentElement view over one node of a FlatDocumentStore
+class FlatElementView : public DocumentElement {
+private:
+    const FlatDocumentStore* store;
+    uint32_t index;
+public:
+    FlatElementView(const FlatDocumentStore* s, uint32_t i) : store(s), index(i) {}
+
+    void draw(IRenderer* renderer) override { store->drawRange(index, renderer); }
+    std::unique_ptr<DocumentElement> clone() const override { return store->materialize(index); }
+    void accept(IDocumentVisitor* visitor) override { store->acceptRange(index, visitor); }
+    std::string getType() const override { return store->typeName(index); }
+
+    uint32_t getIndex() const { return index; }
+};
+
+void FlatDocumentStore::drawRange(uint32_t begin, IRenderer* renderer) const {
+    std::vector<uint32_t> openSections;
+    uint32_t end = subtreeEnds[begin];
+    for (uint32_t i = begin; i < end; ++i) {
+        while (!openSections.empty() && openSections.back() == i) {
+            renderer->endSection();
+            openSections.pop_back();
+        }
+        switch (kinds[i]) {
+        case ElementKind::Paragraph:
+            paragraphs[payloads[i]].draw(renderer);
+            break;
+        case ElementKind::Image:
+        case ElementKind::ImageProxy:
+            renderer->renderImage(stringAt(i));
+            break;
+        case ElementKind::Table:
+            tables[payloads[i]].draw(renderer);
+            break;
+        case ElementKind::Section:
+            renderer->startSection();
+            openSections.push_back(subtreeEnds[i]);
+            break;
+        case ElementKind::Bold:
+        case ElementKind::Italic: {
+            // Mirrors the decorators: only a directly wrapped paragraph is styled
+            uint32_t child = firstChildren[i];
+            if (child != kNone && kinds[child] == ElementKind::Paragraph) {
+                bool bold = kinds[i] == ElementKind::Bold;
+                renderer->renderPieces(paragraphAt(child).getText(), bold, !bold);
+                i = subtreeEnds[i] - 1;
+            }
+            break;
+        }
+        case ElementKind::Shape:
+            shapes[payloads[i]].draw(renderer);
+            break;
+        case ElementKind::Opaque:
+            opaqueAt(i)->draw(renderer);
+            break;
+        }
+    }
+    while (!openSections.empty()) {
+        renderer->endSection();
+        openSections.pop_back();
+    }
+}
+
+// Visitors receive the stored elements, in the same order Section::accept
+// would produce
+void FlatDocumentStore::acceptRange(uint32_t begin, IDocumentVisitor* visitor) const {
+    std::vector<uint32_t> openSections;
+    auto leave = [&]() {
+        visitor->leaveSection(&sections[payloads[openSections.back()]]);
+        openSections.pop_back();
+    };
+    uint32_t end = subtreeEnds[begin];
+    for (uint32_t i = begin; i < end; ++i) {
+        while (!openSections.empty() && subtreeEnds[openSections.back()] == i) leave();
+        switch (kinds[i]) {
+        case ElementKind::Paragraph:
+            visitor->visitParagraph(&paragraphs[payloads[i]]);
+            break;
+        case ElementKind::Image:
+            visitor->visitImage(&images[payloads[i]]);
+            break;
+        case ElementKind::Table:
+            visitor->visitTable(&tables[payloads[i]]);
+            break;
+        case ElementKind::Section:
+            visitor->visitSection(&sections[payloads[i]]);
+            openSections.push_back(i);
+            break;
+        case ElementKind::ImageProxy:
+            visitor->visitImageProxy(&proxies[payloads[i]]);
+            break;
+        case ElementKind::Opaque:
+            opaqueAt(i)->accept(visitor);
+            break;
+        case ElementKind::Bold:
+        case ElementKind::Italic:
+        case ElementKind::Shape:
+            break;
+        }
+    }
+    while (!openSections.empty()) leave();
+}
+
+std::unique_ptr<DocumentElement> FlatDocumentStore::materialize(uint32_t index) const {
+    switch (kinds[index]) {
+    case ElementKind::Paragraph:
+        return paragraphAt(index).clone();
+    case ElementKind::Image:
+        return imageAt(index).clone();
+    case ElementKind::Table:
+        return tableAt(index).clone();
+    case ElementKind::ImageProxy:
+        return imageProxyAt(index).clone();
+    case ElementKind::Section: {
+        auto section = std::make_unique<Section>(sectionAt(index).getName());
+        for (uint32_t c = firstChildren[index]; c != kNone; c = nextSiblings[c]) {
+            section->add(materialize(c));
+        }
+        return section;
+    }
+    case ElementKind::Bold:
+        return std::make_unique<BoldDecorator>(materialize(firstChildren[index]));
+    case ElementKind::Italic:
+        return std::make_unique<ItalicDecorator>(materialize(firstChildren[index]));
+    case ElementKind::Shape:
+        return shapeAt(index).clone();
+    case ElementKind::Opaque:
+        return opaqueAt(index)->clone();
+    }
+    return nullptr;
+}
+
+std::unique_ptr<FlatElementView> FlatDocumentStore::view(uint32_t index) const {
+    return std::make_unique<FlatElementView>(this, index);
+}
+
+// Every edit stamps the root with a new version, so an equal stamp means
+// the tree has not changed since the copy was made
+std::shared_ptr<const FlatDocumentStore> Document::flatStore() const {
+    if (!flatCache || flatVersion != rootSection->getVersion()) {
+        flatCache = std::make_shared<FlatDocumentStore>(*rootSection);
+        flatVersion = rootSection->getVersion();
+    }
+    return flatCache;
+}
+
+// FileManagerFacade is implemented on top of the flat store
+void FileManagerFacade::save(Document* doc, const std::string& path) {
+    std::cout << "[Facade] Saving document to: " << path << std::endl;
+    std::shared_ptr<const FlatDocumentStore> flat = doc->flatStore();
+    const FlatDocumentStore& store = *flat;
+
+    // Strings are written after the records, so collect them as spans first
+    std::vector<std::pair<const char*, size_t>> blob;
+    uint64_t blobSize = 0;
+    auto addString = [&](const char* data, size_t n) {
+        StringRef ref{ blobSize, n };
+        if (n > 0) blob.emplace_back(data, n);
+        blobSize += n;
+        return ref;
+    };
+    auto addStdString = [&](const std::string& value) { return addString(value.data(), value.size()); };
+
+    FileHeader header = {};
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.margins[0] = doc->getMarginTop();
+    header.margins[1] = doc->getMarginBottom();
+    header.margins[2] = doc->getMarginLeft();
+    header.margins[3] = doc->getMarginRight();
+    header.pageSize = addStdString(doc->getPageSize());
+    header.header = addStdString(doc->getHeader());
+    header.footer = addStdString(doc->getFooter());
+
+    std::vector<FormatRecord> formats;
+    std::unordered_map<FormatHandle, uint32_t> formatIndex;
+    auto addFormat = [&](FormatHandle handle) -> uint32_t {
+        if (handle == kNoFormat) return 0;
+        auto found = formatIndex.find(handle);
+        if (found == formatIndex.end()) {
+            const CharacterFormat* fmt = CharacterFormatFactory::resolve(handle);
+            FormatRecord record = {};
+            record.font = addStdString(fmt->fontName);
+            record.color = addStdString(fmt->color);
+            record.size = fmt->fontSize;
+            formats.push_back(record);
+            found = formatIndex.emplace(handle, static_cast<uint32_t>(formats.size())).first;
+        }
+        return found->second;
+    };
+    std::vector<RunRecord> runs;
+
+    // Elements without a binary encoding are left out, and so are decorators
+    // left wrapping nothing, so that every saved file loads back
+    std::vector<bool> dropped(store.size(), false);
+    int skipped = 0;
+    for (uint32_t i = static_cast<uint32_t>(store.size()); i-- > 1;) {
+        ElementKind kind = store.kind(i);
+        uint32_t child = store.firstChild(i);
+        if (kind == ElementKind::Opaque) {
+            dropped[i] = true;
+            skipped++;
+        }
+        else if (kind == ElementKind::Bold || kind == ElementKind::Italic) {
+            dropped[i] = child == FlatDocumentStore::kNone || dropped[child];
+        }
+    }
+
+    std::vector<NodeRecord> nodes;
+    nodes.reserve(store.size());
+    std::vector<uint32_t> written(store.size(), FlatDocumentStore::kNone);  // Store index -> record index
+    for (uint32_t i = 0; i < store.size(); ++i) {
+        if (dropped[i]) continue;
+        NodeRecord node = {};
+        node.kind = static_cast<uint8_t>(store.kind(i));
+        node.parent = i == 0 ? store.parent(i) : written[store.parent(i)];
+        switch (store.kind(i)) {
+        case ElementKind::Paragraph: {
+            const Paragraph& para = store.paragraphAt(i);
+            node.text.offset = blobSize;
+            node.text.length = para.getText().length();
+            para.getText().forEachChunk([&](const char* data, size_t n) { addString(data, n); });
+            node.format = addFormat(para.getFormatHandle());
+            node.values[0] = static_cast<int32_t>(runs.size());
+            node.values[1] = static_cast<int32_t>(para.getRuns().size());
+            for (const StyleRun& run : para.getRuns()) {
+                RunRecord record = {};
+                record.offset = run.offset;
+                record.length = run.length;
+                record.format = addFormat(run.format);
+                record.styles = run.styles;
+                runs.push_back(record);
+            }
+            break;
+        }
+        case ElementKind::Section:
+        case ElementKind::Image:
+        case ElementKind::ImageProxy:
+            node.text = addStdString(store.stringAt(i));
+            break;
+        case ElementKind::Table:
+            node.values[0] = store.tableAt(i).getRows();
+            node.values[1] = store.tableAt(i).getCols();
+            break;
+        case ElementKind::Shape: {
+            const ShapeAdapter& shape = store.shapeAt(i);
+            node.values[0] = shape.getX();
+            node.values[1] = shape.getY();
+            node.values[2] = shape.getWidth();
+            node.values[3] = shape.getHeight();
+            break;
+        }
+        case ElementKind::Bold:
+        case ElementKind::Italic:
+        case ElementKind::Opaque:
+            break;
+        }
+        written[i] = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(node);
+    }
+    header.nodeCount = static_cast<uint32_t>(nodes.size());
+    header.formatCount = static_cast<uint32_t>(formats.size());
+    header.runCount = static_cast<uint32_t>(runs.size());
+    header.stringBytes = blobSize;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cout << "[Facade] Cannot open file for writing: " << path << std::endl;
+        return;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(formats.data()), formats.size() * sizeof(FormatRecord));
+    file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(NodeRecord));
+    file.write(reinterpret_cast<const char*>(runs.data()), runs.size() * sizeof(RunRecord));
+    for (auto& span : blob) file.write(span.first, span.second);
+    file.close();
+    if (!file) {
+        std::cout << "[Facade] Failed writing document: " << path << std::endl;
+        return;
+    }
+    if (skipped > 0) {
+        std::cout << "[Facade] " << skipped << " element(s) without a binary encoding were not saved\n";
+    }
+    std::cout << "[Facade] Document saved successfully!\n";
+}
+
+std::unique_ptr<Document> FileManagerFacade::load(const std::string& path) {
+    std::cout << "[Facade] Loading document from: " << path << std::endl;
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        std::cout << "[Facade] Cannot open file: " << path << std::endl;
+        return nullptr;
+    }
+
+    // XML exports are parsed straight from the mapping
+    size_t lead = 0;
+    if (file.size() >= 3 && std::memcmp(file.data(), "\xEF\xBB\xBF", 3) == 0) lead = 3;
+    while (lead < file.size() && std::isspace(static_cast<unsigned char>(file.data()[lead]))) lead++;
+    if (lead < file.size() && file.data()[lead] == '<') {
+        XmlSaxReader reader(file.data() + lead, file.size() - lead);
+        return importXml(reader, path);
+    }
+
+    // The header and record tables are used in place, straight from the mapping
+    FileHeader header;
+    if (file.size() < sizeof(header)) {
+        std::cout << "[Facade] Not a document file: " << path << std::endl;
+        return nullptr;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    uint64_t tablesEnd = sizeof(FileHeader) + uint64_t(header.formatCount) * sizeof(FormatRecord)
+        + uint64_t(header.nodeCount) * sizeof(NodeRecord) + uint64_t(header.runCount) * sizeof(RunRecord);
+    if (header.magic != kMagic || header.version != kVersion || header.nodeCount == 0
+        || tablesEnd > file.size() || header.stringBytes > file.size() - tablesEnd) {
+        std::cout << "[Facade] Not a document file: " << path << std::endl;
+        return nullptr;
+    }
+    auto* formatRecords = reinterpret_cast<const FormatRecord*>(file.data() + sizeof(FileHeader));
+    auto* nodes = reinterpret_cast<const NodeRecord*>(formatRecords + header.formatCount);
+    auto* runRecords = reinterpret_cast<const RunRecord*>(nodes + header.nodeCount);
+    const char* strings = file.data() + tablesEnd;
+
+    bool corrupt = false;
+    // Bounds-checked span of the string blob
+    auto span = [&](const StringRef& ref) -> std::pair<const char*, size_t> {
+        if (ref.offset > header.stringBytes || ref.length > header.stringBytes - ref.offset) {
+            corrupt = true;
+            return { strings, 0 };
+        }
+        return { strings + ref.offset, static_cast<size_t>(ref.length) };
+    };
+    auto str = [&](const StringRef& ref) {
+        auto text = span(ref);
+        return std::string(text.first, text.second);
+    };
+
+    std::vector<FormatHandle> formats;
+    formats.reserve(header.formatCount);
+    for (uint32_t i = 0; i < header.formatCount; ++i) {
+        const FormatRecord& record = formatRecords[i];
+        formats.push_back(CharacterFormatFactory::internQuiet(str(record.font), record.size, str(record.color)));
+    }
+
+    // Everything built from here on is carved from the new document's arena
+    auto doc = std::make_unique<Document>();
+    doc->enableArena();
+    ElementArena::Scope scope = doc->allocationScope();
+
+    // Records are in document order, so each element is built once, straight
+    // from its record, and added to its section as soon as it is read. A
+    // decorator is held open until the element it wraps arrives; one whose
+    // content was never saved is dropped.
+    enum class Slot : uint8_t { Unused, Section, Decorator, DecoratorChained, DecoratorFilled, Leaf, Skipped };
+    std::vector<Slot> slots(header.nodeCount, Slot::Unused);
+    std::vector<Section*> sections(header.nodeCount, nullptr);
+    auto attach = [&](uint32_t parent, std::unique_ptr<DocumentElement> element) {
+        while (slots[parent] == Slot::Decorator || slots[parent] == Slot::DecoratorChained) {
+            slots[parent] = Slot::DecoratorFilled;
+            if (static_cast<ElementKind>(nodes[parent].kind) == ElementKind::Bold) element = std::make_unique<BoldDecorator>(std::move(element));
+            else element = std::make_unique<ItalicDecorator>(std::move(element));
+            parent = nodes[parent].parent;
+        }
+        sections[parent]->add(std::move(element));
+    };
+
+    if (static_cast<ElementKind>(nodes[0].kind) != ElementKind::Section) corrupt = true;
+    else {
+        doc->getRootSection()->setName(str(nodes[0].text));
+        slots[0] = Slot::Section;
+        sections[0] = doc->getRootSection();
+    }
+    int skipped = 0;
+    for (uint32_t i = 1; i < header.nodeCount && !corrupt; ++i) {
+        const NodeRecord& node = nodes[i];
+        // The parent must be an open section or a decorator still waiting for its element
+        if (node.parent >= i || node.format > header.formatCount
+            || (slots[node.parent] != Slot::Section && slots[node.parent] != Slot::Decorator)) {
+            corrupt = true;
+            break;
+        }
+        std::unique_ptr<DocumentElement> element;
+        switch (static_cast<ElementKind>(node.kind)) {
+        case ElementKind::Paragraph: {
+            auto text = span(node.text);
+            uint32_t firstRun = static_cast<uint32_t>(node.values[0]);
+            uint32_t runCount = static_cast<uint32_t>(node.values[1]);
+            if (firstRun > header.runCount || runCount > header.runCount - firstRun) {
+                corrupt = true;
+                break;
+            }
+            // Runs must be non-empty, sorted, disjoint and inside the text
+            StyleRuns runs;
+            runs.reserve(runCount);
+            uint64_t covered = 0;
+            for (uint32_t r = firstRun; r < firstRun + runCount && !corrupt; ++r) {
+                const RunRecord& record = runRecords[r];
+                uint64_t end = uint64_t(record.offset) + record.length;
+                if (record.format > header.formatCount || record.length == 0 || record.offset < covered || end > text.second) {
+                    corrupt = true;
+                    break;
+                }
+                covered = end;
+                runs.push_back(StyleRun{ record.offset, record.length,
+                    record.format ? formats[record.format - 1] : kNoFormat, record.styles });
+            }
+            element = std::make_unique<Paragraph>(PieceTable(text.first, text.second),
+                node.format ? formats[node.format - 1] : kNoFormat, std::move(runs));
+            break;
+        }
+        case ElementKind::Section: {
+            auto section = std::make_unique<Section>(str(node.text));
+            sections[i] = section.get();
+            element = std::move(section);
+            break;
+        }
+        case ElementKind::Image:
+            element = std::make_unique<Image>(str(node.text));
+            break;
+        case ElementKind::ImageProxy:
+            element = std::make_unique<ImageProxy>(str(node.text));
+            break;
+        case ElementKind::Table:
+            element = std::make_unique<Table>(node.values[0], node.values[1]);
+            break;
+        case ElementKind::Shape:
+            element = std::make_unique<ShapeAdapter>(node.values[0], node.values[1], node.values[2], node.values[3]);
+            break;
+        case ElementKind::Bold:
+        case ElementKind::Italic:
+            slots[i] = Slot::Decorator;
+            if (slots[node.parent] == Slot::Decorator) slots[node.parent] = Slot::DecoratorChained;
+            break;
+        case ElementKind::Opaque:
+            // Older files hold a placeholder record for elements saved without content
+            slots[i] = Slot::Skipped;
+            if (slots[node.parent] == Slot::Decorator) slots[node.parent] = Slot::DecoratorChained;
+            skipped++;
+            break;
+        default:
+            corrupt = true;
+            break;
+        }
+        if (element && !corrupt) {
+            slots[i] = sections[i] ? Slot::Section : Slot::Leaf;
+            attach(node.parent, std::move(element));
+        }
+    }
+    if (corrupt) {
+        std::cout << "[Facade] Document file is corrupt: " << path << std::endl;
+        return nullptr;
+    }
+    for (Slot slot : slots) {
+        if (slot == Slot::Decorator || slot == Slot::DecoratorChained) skipped++;
+    }
+
+    doc->setProperties(str(header.pageSize), header.margins[0], header.margins[1],
+        header.margins[2], header.margins[3], str(header.header), str(header.footer));
+    if (skipped > 0) {
+        std::cout << "[Facade] " << skipped << " element(s) saved without content were skipped\n";
+    }
+    std::cout << "[Facade] Document loaded successfully!\n";
+    return doc;
+}
+
+std::unique_ptr<Document> FileManagerFacade::importXml(XmlSaxReader& reader, const std::string& source) {
+    // Like load(), the parsed elements are carved from the new document's arena
+    auto doc = std::make_unique<Document>();
+    doc->enableArena();
+    ElementArena::Scope scope = doc->allocationScope();
+    DocumentXmlBuilder builder(doc.get());
+    if (!reader.parse(builder)) {
+        std::cout << "[Facade] Malformed XML in " << source << ": " << reader.error() << std::endl;
+        return nullptr;
+    }
+    if (builder.getSkipped() > 0) {
+        std::cout << "[Facade] " << builder.getSkipped() << " unknown XML element(s) were ignored\n";
+    }
+    std::cout << "[Facade] Document loaded successfully!\n";
+    return doc;
+}
+
+std::unique_ptr<Document> FileManagerFacade::loadXml(int fd) {
+    std::cout << "[Facade] Loading XML document from descriptor " << fd << std::endl;
+    XmlSaxReader reader(fd);
+    return importXml(reader, "descriptor " + std::to_string(fd));
+}
+
+void FileManagerFacade::saveXml(Document* doc, const std::string& path) {
+    std::cout << "[Facade] Exporting XML to: " << path << std::endl;
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cout << "[Facade] Cannot open file for writing: " << path << std::endl;
+        return;
+    }
+    {
+        FileSink sink(file);
+        XMLExportVisitor xml(sink);
+        doc->getRootSection()->accept(&xml);
+    }
+    bool failed = std::ferror(file) != 0;
+    if (std::fclose(file) != 0 || failed) {
+        std::cout << "[Facade] Failed writing document: " << path << std::endl;
+        return;
+    }
+    std::cout << "[Facade] Document exported successfully!\n";
+}
+
+// ==========================================================
+// VARIANT DOCUMENT MODEL
+// ==========================================================
+
+// Closed-set alternative to the virtual element hierarchy. Leaves are the
+// ordinary element classes held by value; sections and decorators are plain
+// structs. Operations dispatch through std::visit, which resolves the type
+// from the variant index at compile time and calls leaf members
+// non-virtually. Elements outside the built-in set are kept as
+// VariantOpaque and still go through their vtable.
+struct VariantSection;
+struct VariantDecorated;
+struct VariantOpaque;
+using VariantElement = std::variant<Paragraph, Image, Table, ImageProxy,
+    VariantSection, VariantDecorated, VariantOpaque>;
+
+struct VariantSection {
+    std::string name;
+    std::vector<VariantElement> children;
+};
+
+struct VariantDecorated {
+    ElementKind style;                      // Bold or Italic
+    std::unique_ptr<VariantElement> inner;
+};
+
+struct VariantOpaque {
+    std::unique_ptr<DocumentElement> element;
+};
+
+template <typename... Fs>
+struct Overloaded : Fs... { using Fs::operator()...; };
+template <typename... Fs>
+Overloaded(Fs...) -> Overloaded<Fs...>;
+
+// Converts a live subtree; paragraphs share their piece tables
+VariantElement toVariant(const DocumentElement* element) {
+    return dispatchElement(element, Overloaded{
+        [](const Paragraph& para) -> VariantElement { return para; },
+        [](const Image& img) -> VariantElement { return img; },
+        [](const Table& table) -> VariantElement { return table; },
+        [](const ImageProxy& proxy) -> VariantElement { return ImageProxy(proxy.getPath()); },
+        [](const Section& sec) -> VariantElement {
+            VariantSection out{ sec.getName(), {} };
+            out.children.reserve(sec.getChildren().size());
+            for (auto& child : sec.getChildren()) out.children.push_back(toVariant(child.get()));
+            return out;
+        },
+        [](const TextDecorator& decorator) -> VariantElement {
+            return VariantDecorated{ decorator.getKind(),
+                std::make_unique<VariantElement>(toVariant(decorator.getWrapped())) };
+        },
+        [](const DocumentElement& other) -> VariantElement { return VariantOpaque{ other.clone() }; },
+    });
+}
+
+std::unique_ptr<DocumentElement> toElement(const VariantElement& node) {
+    return std::visit(Overloaded{
+        [](const Paragraph& para) -> std::unique_ptr<DocumentElement> { return para.Paragraph::clone(); },
+        [](const Image& img) -> std::unique_ptr<DocumentElement> { return img.Image::clone(); },
+        [](const Table& table) -> std::unique_ptr<DocumentElement> { return table.Table::clone(); },
+        [](const ImageProxy& proxy) -> std::unique_ptr<DocumentElement> { return proxy.ImageProxy::clone(); },
+        [](const VariantSection& sec) -> std::unique_ptr<DocumentElement> {
+            auto out = std::make_unique<Section>(sec.name);
+            for (auto& child : sec.children) out->add(toElement(child));
+            return out;
+        },
+        [](const VariantDecorated& decorated) -> std::unique_ptr<DocumentElement> {
+            if (decorated.style == ElementKind::Bold) return std::make_unique<BoldDecorator>(toElement(*decorated.inner));
+            return std::make_unique<ItalicDecorator>(toElement(*decorated.inner));
+        },
+        [](const VariantOpaque& opaque) -> std::unique_ptr<DocumentElement> { return opaque.element->clone(); },
+    }, node);
+}
+
+VariantElement cloneVariant(const VariantElement& node) {
+    return std::visit(Overloaded{
+        [](const ImageProxy& proxy) -> VariantElement { return ImageProxy(proxy.getPath()); },
+        [](const VariantSection& sec) -> VariantElement {
+            VariantSection out{ sec.name, {} };
+            out.children.reserve(sec.children.size());
+            for (auto& child : sec.children) out.children.push_back(cloneVariant(child));
+            return out;
+        },
+        [](const VariantDecorated& decorated) -> VariantElement {
+            return VariantDecorated{ decorated.style, std::make_unique<VariantElement>(cloneVariant(*decorated.inner)) };
+        },
+        [](const VariantOpaque& opaque) -> VariantElement { return VariantOpaque{ opaque.element->clone() }; },
+        [](const auto& leaf) -> VariantElement { return leaf; },
+    }, node);
+}
+
+void drawVariant(VariantElement& node, IRenderer* renderer) {
+    std::visit(Overloaded{
+        [&](Paragraph& para) { para.Paragraph::draw(renderer); },
+        [&](Image& img) { img.Image::draw(renderer); },
+        [&](Table& table) { table.Table::draw(renderer); },
+        [&](ImageProxy& proxy) { proxy.ImageProxy::draw(renderer); },
+        [&](VariantSection& sec) {
+            renderer->startSection();
+            for (auto& child : sec.children) drawVariant(child, renderer);
+            renderer->endSection();
+        },
+        [&](VariantDecorated& decorated) {
+            // Mirrors the decorators: only a directly wrapped paragraph is styled
+            if (auto* para = std::get_if<Paragraph>(decorated.inner.get())) {
+                bool bold = decorated.style == ElementKind::Bold;
+                renderer->renderPieces(para->getText(), bold, !bold);
+            }
+            else {
+                drawVariant(*decorated.inner, renderer);
+            }
+        },
+        [&](VariantOpaque& opaque) { opaque.element->draw(renderer); },
+    }, node);
+}
+
+void XMLExportVisitor::visitVariantSection(VariantSection& section) { openSection(section.name); }
+
+// Feeds an ordinary IDocumentVisitor in the same order Section::accept
+// would; sections go to the visitor's VariantSection hooks
+void acceptVariant(VariantElement& node, IDocumentVisitor* visitor) {
+    std::visit(Overloaded{
+        [&](Paragraph& para) { visitor->visitParagraph(&para); },
+        [&](Image& img) { visitor->visitImage(&img); },
+        [&](Table& table) { visitor->visitTable(&table); },
+        [&](ImageProxy& proxy) { visitor->visitImageProxy(&proxy); },
+        [&](VariantSection& sec) {
+            visitor->visitVariantSection(sec);
+            for (auto& child : sec.children) acceptVariant(child, visitor);
+            visitor->leaveVariantSection(sec);
+        },
+        [&](VariantDecorated& decorated) { acceptVariant(*decorated.inner, visitor); },
+        [&](VariantOpaque& opaque) { opaque.element->accept(visitor); },
+    }, node);
+}
+
+// Pre-order walk with the visitor resolved at compile time: fn is called
+// with each node's concrete alternative, decorators before what they wrap.
+// Works on const and non-const trees.
+template <typename Node, typename F>
+void walkVariant(Node& node, F& fn) {
+    std::visit([&](auto& alt) {
+        fn(alt);
+        using T = std::decay_t<decltype(alt)>;
+        if constexpr (std::is_same<T, VariantSection>::value) {
+            for (auto& child : alt.children) walkVariant(child, fn);
+        }
+        else if constexpr (std::is_same<T, VariantDecorated>::value) {
+            walkVariant(*alt.inner, fn);
+        }
+    }, node);
+}
+
+// A whole document in the variant representation
+class VariantDocument {
+private:
+    VariantSection root;
+
+    static int countBelow(const VariantSection& section) {
+        int count = 0;
+        for (auto& child : section.children) {
+            count++;
+            if (auto* sec = std::get_if<VariantSection>(&child)) count += countBelow(*sec);
+        }
+        return count;
+    }
+
+public:
+    explicit VariantDocument(const Section& section) : root{ section.getName(), {} } {
+        root.children.reserve(section.getChildren().size());
+        for (auto& child : section.getChildren()) root.children.push_back(toVariant(child.get()));
+    }
+
+    VariantSection& getRoot() { return root; }
+    const VariantSection& getRoot() const { return root; }
+
+    void draw(IRenderer* renderer) {
+        renderer->startSection();
+        for (auto& child : root.children) drawVariant(child, renderer);
+        renderer->endSection();
+        renderer->flush();
+    }
+
+    void accept(IDocumentVisitor* visitor) {
+        visitor->visitVariantSection(root);
+        for (auto& child : root.children) acceptVariant(child, visitor);
+        visitor->leaveVariantSection(root);
+    }
+
+    template <typename F>
+    void walk(F&& fn) const {
+        for (auto& child : root.children) walkVariant(child, fn);
+    }
+
+    // Elements below the root, counted like DocumentIterator lists them
+    int countElements() const { return countBelow(root); }
+
+    int countWords() const {
+        int count = 0;
+        walk(Overloaded{
+            [&](const Paragraph& para) { count += para.getWordCount(); },
+            [](const auto&) {},
+        });
+        return count;
+    }
+
+    std::unique_ptr<Section> toSection() const {
+        auto out = std::make_unique<Section>(root.name);
+        for (auto& child : root.children) out->add(toElement(child));
+        return out;
+    }
+};
+
 // ==========================================================
 // MAIN DEMONSTRATION
 // ==========================================================
 
+// Define DOCUMENT_EDITOR_NO_MAIN to include the framework in another program
+// (e.g. document_editor_benchmark.cpp)
+#ifndef DOCUMENT_EDITOR_NO_MAIN
 int main() {
     std::cout << "========================================\n";
     std::cout << "DOCUMENT EDITOR FRAMEWORK DEMO\n";
@@ -995,7 +6083,7 @@ int main() {
     // 5. COMPOSITE - Section hierarchy
     std::cout << "--- 5. COMPOSITE ---\n";
     auto section = ElementFactory::createSection("Chapter 1");
-    auto sectionPtr = dynamic_cast<Section*>(section.get());
+    auto sectionPtr = elementCast<Section>(section.get());
     sectionPtr->add(ElementFactory::createParagraph("Chapter 1 content"));
     doc->addElement(std::move(section));
     std::cout << "Composite section added\n\n";
@@ -1042,7 +6130,11 @@ int main() {
     // 10. FACADE - File operations
     std::cout << "--- 10. FACADE ---\n";
     FileManagerFacade fileManager;
-    fileManager.save(doc.get(), "mydocument.txt");
+    fileManager.save(doc.get(), "mydocument.sdoc");
+    auto loadedDoc = fileManager.load("mydocument.sdoc");
+    if (loadedDoc) {
+        std::cout << "Loaded elements: " << loadedDoc->flatStore()->countElements() << "\n";
+    }
     std::cout << "\n";
 
     // 11. ADAPTER - Legacy shape integration
@@ -1078,6 +6170,10 @@ int main() {
     ));
     history.undo();
     history.redo();
+    auto memento = doc->createMemento();
+    doc->addElement(ElementFactory::createParagraph("Edit after checkpoint"));
+    doc->restoreMemento(memento);
+    std::cout << "Memento restored (state: " << memento.getStateName() << ")\n";
     std::cout << "\n";
 
     // 15. STRATEGY - Export strategies
@@ -1147,4 +6243,5 @@ int main() {
     std::cout << "========================================\n";
 
     return 0;
-}
\ No newline at end of file
+}
+#endif